@@ -3,13 +3,36 @@
 #ifndef _ALLOC_H
 #define _ALLOC_H
 
+// Granularity of the free-space bitmap, in bytes
+#define ALLOC_UNIT 8
+
+// Percentage of the disk given to the block zone (the block table and the data region).
+// The rest holds file headers, index blocks, directory indexes and the journal
+#define BLOCK_ZONE_PERCENT 60
+
+int allocator_init();
+
+int allocator_load();
+
+void allocator_free();
+
+const struct Disk_segment* get_segment(unsigned long address);
+
+unsigned long get_free_space();
+
+unsigned long get_growable_space();
+
 void flush(unsigned long from, unsigned long to);
 
 void* allocate(unsigned long size);
 
+struct Data_block* try_allocate_blocks(unsigned long count);
+
+void release_free_lists();
+
 struct FSFILE* allocate_file(const char* path, int file_type);
 
-struct Data_block* allocate_blocks(int count);
+struct Data_block* allocate_blocks(int count, struct Data_block** last);
 
 int deallocate_file(struct FSFILE* file);
 
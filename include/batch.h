@@ -0,0 +1,10 @@
+// batch.h
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdio.h>
+
+int run_batch(FILE* input, FILE* output);
+
+#endif
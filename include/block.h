@@ -3,26 +3,53 @@
 #ifndef _BLOCK_H
 #define _BLOCK_H
 
-#define BLOCK_SIZE 32
-
 enum Block_types {
 	BLOCK_NONE,
     BLOCK_USED = 1,
     BLOCK_FREE,
     BLOCK_FILE_HEADER,
     BLOCK_FILE_HEADER_FREE,
+    BLOCK_INDEX,
+    BLOCK_DIR_INDEX,
+    BLOCK_DIR_BUCKET,
     
     BLOCK_TYPES_COUNT
 };
 
+// Metadata of a data block, kept in the block table (see FS_disk_header). The data itself
+// is at the same index in the data region (see get_block_data)
 struct Data_block {
     char block_type;    // BLOCK_USED, BLOCK_FREE
-    char data[BLOCK_SIZE];
     int bytes_used;     // Number of bytes written in this block
     unsigned long next;
 };
 
-#define TOTAL_BLOCK_SIZE sizeof(struct Data_block)
+// The data region starts on a cache line, so blocks of a power of two size up to this,
+// or of a multiple of it, never straddle cache lines
+#define BLOCK_DATA_ALIGN 64
+
+// Disk space taken by a block, its metadata included
+#define TOTAL_BLOCK_SIZE (sizeof(struct Data_block) + get_block_size())
+
+// Walks a chain of data blocks in constant stack space:
+//     for (block = cursor_start(&cursor, addr); block; block = cursor_next(&cursor))
+// Every block is checked before it's handed out and the one after it is prefetched.
+// The link is saved on arrival, so the current block may be freed or relinked
+struct Block_cursor {
+    struct Data_block* block;   // NULL at the end of the chain or at a broken link
+    unsigned long address;
+    unsigned long next;
+    unsigned long steps;
+    unsigned long limit;        // More steps than the disk has blocks means the chain loops
+};
+
+unsigned long get_block_size();
+
+char* get_block_data(const struct Data_block* block);
+
+struct Data_block* cursor_start(struct Block_cursor* cursor, unsigned long block_addr);
+
+struct Data_block* cursor_next(struct Block_cursor* cursor);
 
 void print_block_info(struct Data_block* block, FILE* output);
 
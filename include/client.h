@@ -0,0 +1,14 @@
+// client.h
+
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include <stdio.h>
+
+int client_connect(const char* socket_path);
+
+int client_request(int server, int op, const char* path, const void* data, unsigned long size, FILE* output);
+
+int client_request_fd(int server, int op, const char* path, int fd, FILE* output);
+
+#endif
@@ -8,6 +8,16 @@
 #define DEFAULT_DISK_PATH "data/"
 #define DEFAULT_DISK_NAME "test"
 #define DEFAULT_DISK_SIZE (1024 << 4)
+// Disks grow on demand up to this size. Address space for it is reserved up front, so the
+// disk never has to move in memory
+#define MAX_DISK_SIZE (1UL << 36)
+
+#define DEFAULT_SOCKET_PATH DATA_PATH "/data/" PROGRAM_NAME ".sock"
+
+// Block sizes must be a multiple of the directory entry size, so that entries never cross blocks
+#define DEFAULT_BLOCK_SIZE 32
+#define MIN_BLOCK_SIZE 16
+#define MAX_BLOCK_SIZE (1024 << 6)
 
 #if LOCAL_BUILD
 #define DATA_PATH "."
@@ -0,0 +1,10 @@
+// convert.h
+
+#ifndef _CONVERT_H
+#define _CONVERT_H
+
+#include <stdio.h>
+
+int convert_disk(const char* path, FILE* output);
+
+#endif
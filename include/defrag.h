@@ -0,0 +1,23 @@
+// defrag.h
+
+#ifndef _DEFRAG_H
+#define _DEFRAG_H
+
+#include <stdio.h>
+
+struct Frag_stats {
+    unsigned long files;
+    unsigned long blocks;
+    unsigned long extents;      // Runs of blocks that follow each other on the disk
+    unsigned long fragmented;   // Files made of more than one extent
+    unsigned long links;        // Pairs of consecutive blocks within a file
+    unsigned long breaks;       // Pairs that aren't next to each other on the disk
+};
+
+void get_frag_stats(struct Frag_stats* stats);
+
+void print_frag_stats(const struct Frag_stats* stats, const char* label, FILE* output);
+
+int defrag_disk(FILE* output);
+
+#endif
@@ -0,0 +1,39 @@
+// dentry.h
+
+#ifndef _DENTRY_H
+#define _DENTRY_H
+
+// Number of path components remembered by get_path_dir
+#define DENTRY_CACHE_SIZE 256
+#define DENTRY_BUCKETS 256
+
+// One resolved path component. file is 0 for a component that doesn't exist
+struct Dentry {
+    unsigned long dir;
+    unsigned long id;
+    unsigned long file;
+    char name[FILE_NAME_SIZE];
+    int hash_next;      // Entries are linked by index + 1, so 0 ends a list
+    int lru_prev;
+    int lru_next;
+};
+
+struct Dentry_cache {
+    int count;
+    int lru_head;       // Most recently used
+    int lru_tail;
+    int buckets[DENTRY_BUCKETS];
+    struct Dentry entries[DENTRY_CACHE_SIZE];
+};
+
+int dentry_lookup(unsigned long dir, unsigned long id, const char* name, unsigned long* file);
+
+void dentry_insert(unsigned long dir, unsigned long id, const char* name, unsigned long file);
+
+void dentry_invalidate(unsigned long dir, unsigned long id, const char* name);
+
+void dentry_invalidate_dir(unsigned long dir);
+
+void dentry_free();
+
+#endif
@@ -5,9 +5,24 @@
 
 #include <stdio.h>
 
-int find_in_dir(const struct FSFILE* dir, const struct FSFILE* file, addr_t** location);
+// Directory data is an array of entries. The first two are the directory itself and its parent.
+// The id and type are kept next to the header address, so scanning a directory only reads
+// its own blocks and a header is only read when the id matches
+struct Dir_entry {
+    unsigned long id;
+    unsigned long type : 8;     // T_FILE, T_DIR
+    unsigned long file : 56;    // Address of the file header, 0 for a removed file
+};
 
-int read_dir_contents(const struct FSFILE* file, unsigned long block_addr, int iteration, FILE* output);
+// Compact a directory once this many of its entries, and at least 1/DIR_COMPACT_RATIO of them, are cleared
+#define DIR_COMPACT_MIN_DEAD 16
+#define DIR_COMPACT_RATIO 4
+
+struct Dir_entry* get_dir_entry(const struct FSFILE* dir, unsigned long n);
+
+int find_in_dir(const struct FSFILE* dir, const struct FSFILE* file, struct Dir_entry** location);
+
+int read_dir_contents(const struct FSFILE* file, FILE* output);
 
 struct FSFILE* get_path_dir(const char* path, struct FSFILE** file);
 
@@ -17,6 +32,10 @@ int is_dir(const struct FSFILE* file);
 
 int can_remove_dir(const struct FSFILE* file);
 
+int compact_dir(struct FSFILE* dir);
+
+void release_dir_entry(struct FSFILE* dir, struct Dir_entry* entry);
+
 int fill_empty_file_slots(struct Data_block* block, int from_index);
 
 #endif
\ No newline at end of file
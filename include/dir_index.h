@@ -0,0 +1,42 @@
+// dir_index.h
+
+#ifndef _DIR_INDEX_H
+#define _DIR_INDEX_H
+
+// Directories with at least this many entry slots get a hash index
+#define DIR_INDEX_THRESHOLD 32
+
+#define DIR_BUCKET_ENTRIES 16
+#define DIR_INDEX_MAX_DEPTH 20
+
+struct Dir_bucket_entry {
+    unsigned long id;
+    unsigned long slot;     // Address of the directory entry
+};
+
+// Extendible hashing: the index holds 2^depth bucket addresses, selected by the low
+// bits of the id. Buckets with a smaller local depth are shared by several of them
+struct Dir_index {
+    char block_type;    // BLOCK_DIR_INDEX
+    int depth;
+    unsigned long buckets[];
+};
+
+struct Dir_bucket {
+    char block_type;    // BLOCK_DIR_BUCKET
+    int depth;
+    int count;
+    struct Dir_bucket_entry entries[DIR_BUCKET_ENTRIES];
+};
+
+unsigned long dir_index_find(const struct FSFILE* dir, unsigned long id, const char* name);
+
+int dir_index_insert(struct FSFILE* dir, unsigned long id, unsigned long slot);
+
+void dir_index_remove(struct FSFILE* dir, unsigned long id, unsigned long slot);
+
+int dir_index_build(struct FSFILE* dir);
+
+void dir_index_free(struct FSFILE* dir);
+
+#endif
@@ -0,0 +1,32 @@
+// disk.h
+
+#ifndef _DISK_H
+#define _DISK_H
+
+// Granularity of dirty tracking, in bytes. Kept small so that journal records stay compact
+#define DIRTY_GRANULE 64
+
+struct Disk_range {
+    unsigned long from;
+    unsigned long to;
+};
+
+char* reserve_disk(unsigned long size);
+
+int map_disk(const char* path);
+
+int extend_disk(unsigned long size);
+
+int dump_disk(const char* path);
+
+int is_disk_path(const char* path);
+
+int take_dirty_ranges(struct Disk_range** ranges, unsigned long* count);
+
+int write_range(unsigned long from, unsigned long to);
+
+int sync_disk();
+
+void unmap_disk();
+
+#endif
@@ -5,6 +5,12 @@
 
 #define FILE_NAME_SIZE 32
 
+// Blocks referenced straight from the file header before index blocks are needed
+#define FILE_DIRECT_BLOCKS 12
+// Single, double and triple indirect index blocks. The last tree gets more levels when a
+// file outgrows it (see FSFILE.extra_levels), so the disk bounds the size of a file
+#define FILE_INDIRECT_LEVELS 3
+
 enum File_types {
     T_NONE,
     T_FILE = 1,
@@ -21,12 +27,21 @@ enum File_mode {
 
 struct FSFILE {
     char block_type;    // BLOCK_FILE_HEADER, BLOCK_FILE_HEADER_FREE
-    char name[FILE_NAME_SIZE];
+    char name[FILE_NAME_SIZE + 1];  // The byte after the name is always 0, so it can be printed
+    unsigned char extra_levels; // Levels added on top of the last indirect tree (this was padding, so 0 on older disks)
+    unsigned char unindexed;    // Set on directories whose hash index couldn't take an entry, so it isn't rebuilt on every create (also padding before)
     unsigned long id;   // id = hash + file type
-    int size;   // Size in bytes
+    unsigned long size;   // Size in bytes
     int type;   // T_FILE, T_DIR
     int mode;   // MODE_NONE, MODE_READ, MODE_WRITE, MODE_APPEND
+    unsigned long position;     // Offset used by fs_write, set with fs_seek
     unsigned long first_block;
+    unsigned long last_block;   // Tail of the block chain, so that appending doesn't have to traverse it
+    unsigned long block_count;
+    unsigned long direct[FILE_DIRECT_BLOCKS];
+    unsigned long indirect[FILE_INDIRECT_LEVELS];
+    unsigned long dir_index;    // Hash index of the entries of large directories (see dir_index.h)
+    unsigned long dead_entries; // Cleared directory entries that haven't been compacted away yet
 };
 
 #define TOTAL_FILE_HEADER_SIZE sizeof(struct FSFILE)
@@ -15,14 +15,54 @@
 
 #include "config.h"
 #include "hash.h"
+#include "fs2.h"
 
 #define HEADER_MAGIC 0xbeefaaaa
 
+// Layout of the disk. Version 1 stored each block's data right after its metadata, with
+// the blocks allocated from the same space as everything else (see convert.h)
+#define FS_VERSION 2
+
 struct FS_disk_header {
     int magic;
+    int version;        // FS_VERSION (0 on version 1 disks, where this was padding)
     unsigned long disk_size;
+    unsigned long block_size;   // Number of data bytes in each block
     unsigned long root_directory;
     unsigned long current_directory;
+    unsigned long bitmap;       // Address of the free-space bitmap (one bit per ALLOC_UNIT bytes)
+    unsigned long bitmap_size;  // Size of the bitmap in bytes
+    unsigned long free_units;   // Number of unused allocation units
+    unsigned long next_free;    // Unit to resume searching for free space from
+    unsigned long free_blocks;          // Free list of data blocks
+    unsigned long free_file_headers;    // Free list of file headers
+    unsigned long free_block_count;
+    unsigned long free_file_header_count;
+    unsigned long journal;      // Address of the journal region
+    unsigned long journal_size;
+    // Data blocks live in their own zone at the end of the disk: a dense table of block
+    // metadata, then the block data at the same index, starting on a BLOCK_DATA_ALIGN boundary.
+    // Block addresses point into the table
+    unsigned long block_table;
+    unsigned long block_count;
+    unsigned long block_data;
+    unsigned long free_table_units;     // Unused allocation units of the table
+    unsigned long next_free_block;      // Table unit to resume searching for free blocks from
+};
+
+#define SEGMENT_MAGIC 0x5e9a5e9a
+
+// Space added when the disk grows is laid out like a disk of its own: this descriptor, a
+// heap, then a block table and its data region. The first segment is the one described by
+// the disk header (it has no descriptor), every other one starts where the one before it
+// ends, rounded up to ALLOC_UNIT
+struct Disk_segment {
+    int magic;
+    unsigned long start;
+    unsigned long end;
+    unsigned long block_table;
+    unsigned long block_count;
+    unsigned long block_data;
 };
 
 struct FS_state {
@@ -31,6 +71,20 @@ struct FS_state {
     int error;
     FILE* log;
     struct FS_disk_header* disk_header;
+    char* disk_path;    // Image the disk was loaded from
+    int disk_fd;        // Descriptor of the image, -1 when the disk only lives in memory
+    int is_mapped;
+    unsigned long mapped_size;
+    unsigned long reserved_size;    // Address space reserved for the disk to grow into
+    unsigned long* dirty;       // One bit per DIRTY_GRANULE bytes changed since the last sync
+    unsigned long dirty_low;    // Range of granules that may have dirty bits set
+    unsigned long dirty_high;
+    int checkpoint_pending;     // The last journal batches may not be durable at home yet
+    unsigned long journal_overflow; // Records past the end of the image a batch may still need, 0 if none
+    struct Disk_segment* segments;  // Ordered by address (see alloc.c)
+    unsigned long segment_count;
+    unsigned long total_blocks;     // Number of blocks in all segments
+    struct Dentry_cache* dentries;  // Path components resolved by get_path_dir (see dentry.h)
 };
 
 int is_initialized();
@@ -41,15 +95,40 @@ void fslog(char* format, ...);
 
 struct FS_state* get_state();
 
-struct FSFILE* find_file(struct FSFILE* dir, unsigned long id, unsigned long* position, unsigned long* empty_slot);
+struct FSFILE* find_file(struct FSFILE* dir, unsigned long id, const char* name, unsigned long* position, unsigned long* empty_slot);
+
+int is_file_name(const struct FSFILE* file, const char* name);
 
 int write_data(const void* data, unsigned long size, struct FSFILE* file);
 
+int write_data_at(const void* data, unsigned long size, unsigned long offset, struct FSFILE* file);
+
+int punch_data(struct FSFILE* file, unsigned long offset, unsigned long size);
+
+int reserve_data(struct FSFILE* file, unsigned long size);
+
+int truncate_data(struct FSFILE* file, unsigned long size);
+
+unsigned long read_data(const struct FSFILE* file, unsigned long offset, void* buffer, unsigned long size);
+
+unsigned long read_spans(const struct FSFILE* file, unsigned long offset, struct FS_span* spans, unsigned long count);
+
 void write_to_blocks(struct FSFILE* file, const void* data, unsigned long size, unsigned long* bytes_written, unsigned long block_addr);
 
 // Get pointer from address/index on disk
 void* get_ptr(unsigned long address);
 
+// Hint that the memory at ptr is read soon. The blocks of a chain can be anywhere on the
+// disk, so the next block is requested while the current one is being copied
+#if defined(__GNUC__)
+#define prefetch(ptr) __builtin_prefetch(ptr)
+#else
+#define prefetch(ptr) ((void)(ptr))
+#endif
+
+// Record that size bytes at ptr have been changed, so that they are written on the next sync
+void mark_dirty(const void* ptr, unsigned long size);
+
 unsigned long get_absolute_address(const void* address);
 
 int can_access_address(unsigned long address);
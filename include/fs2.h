@@ -9,7 +9,13 @@
 
 typedef struct FSFILE FSFILE;
 
-int fs_init(unsigned long disk_size);
+// Contents of a file as they are stored in the disk image (see fs_read_spans)
+typedef struct FS_span {
+    const char* data;
+    unsigned long size;
+} FS_span;
+
+int fs_init(unsigned long disk_size, unsigned long block_size);
 
 int fs_init_from_disk(const char* path);
 
@@ -27,14 +33,36 @@ void fs_close(FSFILE* file);
 
 int fs_write(const void* data, unsigned long size, FSFILE* file);
 
+int fs_reserve(FSFILE* file, unsigned long size);
+
+long fs_write_fd(FSFILE* file, int fd);
+
+long fs_read_buf(FSFILE* file, void* buffer, unsigned long size);
+
+long fs_pread(const FSFILE* file, unsigned long offset, void* buffer, unsigned long size);
+
+long fs_read_spans(const FSFILE* file, unsigned long offset, FS_span* spans, unsigned long count);
+
+long fs_pwrite(FSFILE* file, unsigned long offset, const void* data, unsigned long size);
+
+int fs_punch_hole(FSFILE* file, unsigned long offset, unsigned long size);
+
+int fs_seek(FSFILE* file, long offset, int whence);
+
+long fs_tell(const FSFILE* file);
+
 void fs_print_file_info(const FSFILE* file, FILE* output);
 
 int fs_pwd(FILE* output);
 
 int fs_read(const FSFILE* file, FILE* output);
 
+long fs_read_fd(const FSFILE* file, int fd);
+
 int fs_list(const char* path, FILE* output);
 
+int fs_defrag(FILE* output);
+
 void fs_dump_disk(const char* path);
 
 int fs_get_error();
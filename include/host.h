@@ -0,0 +1,19 @@
+// host.h
+
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stdio.h>
+
+// Size of the reads and writes used to copy file contents
+#define HOST_CHUNK_SIZE (1 << 16)
+
+int import_tree(const char* host_path, const char* dest, FILE* output);
+
+long read_fd_to_file(struct FSFILE* file, int fd, char* buffer);
+
+long write_file_to_fd(const struct FSFILE* file, int fd);
+
+int export_tree(const char* path, const char* host_path, FILE* output);
+
+#endif
@@ -0,0 +1,43 @@
+// index.h
+
+#ifndef _INDEX_H
+#define _INDEX_H
+
+// Number of block addresses in each index block
+#define INDEX_ENTRIES 64
+
+struct Index_block {
+    char block_type;    // BLOCK_INDEX
+    unsigned long entries[INDEX_ENTRIES];
+};
+
+#define TOTAL_INDEX_BLOCK_SIZE sizeof(struct Index_block)
+
+// Walks the slots of a block map in order, holes included, looking up an index block only
+// once for all the slots in it:
+//     for (addr = map_cursor_start(&cursor, file, n); cursor.index < end; addr = map_cursor_next(&cursor))
+// Each call returns the address in the slot the cursor moved to, 0 for a hole
+struct Map_cursor {
+    const struct FSFILE* file;
+    unsigned long index;    // Block number of the slot the cursor is at
+    unsigned long* slot;    // NULL when the index block holding the slot isn't there
+    unsigned long to;       // Block number after the last slot next to this one
+};
+
+unsigned long map_cursor_start(struct Map_cursor* cursor, const struct FSFILE* file, unsigned long index);
+
+unsigned long map_cursor_next(struct Map_cursor* cursor);
+
+unsigned long find_block_before(const struct FSFILE* file, unsigned long index);
+
+unsigned long get_file_block(const struct FSFILE* file, unsigned long index);
+
+int map_file_block(struct FSFILE* file, unsigned long index, unsigned long block_addr);
+
+void prune_file_index(struct FSFILE* file);
+
+void truncate_file_index(struct FSFILE* file, unsigned long count);
+
+void free_file_index(struct FSFILE* file);
+
+#endif // _INDEX_H
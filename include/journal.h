@@ -0,0 +1,47 @@
+// journal.h
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include "disk.h"
+
+#define JOURNAL_MAGIC 0x6a6f726e
+
+// The journal takes up 1/JOURNAL_FRACTION of the disk, within these bounds. It is split
+// into two halves that hold alternate batches. Batches too large for a half overflow past
+// the end of the image (see journal_commit)
+#define JOURNAL_FRACTION 8
+#define JOURNAL_MIN_SIZE (1024 << 1)
+#define JOURNAL_MAX_SIZE (1024 << 16)
+
+enum Journal_states {
+    JOURNAL_EMPTY,
+    JOURNAL_COMMITTED,
+    JOURNAL_OVERFLOWED  // Committed, with the records at the address that follows the header
+};
+
+// Header of each half of the journal
+struct Journal_header {
+    int magic;
+    int state;      // JOURNAL_EMPTY, JOURNAL_COMMITTED, JOURNAL_OVERFLOWED
+    unsigned long sequence;
+    unsigned long length;   // Number of bytes of records after the header
+    unsigned long checksum; // Hash of the records
+};
+
+// Redo record: size bytes that belong at address follow the record, padded to a multiple of 8
+struct Journal_record {
+    unsigned long address;
+    unsigned long size;
+    char data[];
+};
+
+int journal_init();
+
+int journal_replay(int fd);
+
+int journal_commit(const struct Disk_range* ranges, unsigned long count);
+
+int journal_checkpoint();
+
+#endif
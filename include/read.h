@@ -7,4 +7,6 @@ char* read_file(const char* path);
 
 char* read_open_file(FILE* file);
 
+char* read_stream(FILE* file, unsigned long* size);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+// server.h
+
+#ifndef _SERVER_H
+#define _SERVER_H
+
+// Overrides DEFAULT_SOCKET_PATH for both the daemon and the clients
+#define SOCKET_PATH_ENV "FS2_SOCKET"
+
+enum Server_ops {
+    OP_NONE,
+    OP_CREATE = 1,
+    OP_READ,
+    OP_INFO,
+    OP_WRITE,
+    OP_APPEND,
+    OP_REMOVE,
+    OP_MKDIR,
+    OP_CHDIR,
+    OP_LIST,
+    OP_PWD,
+    OP_DEFRAG,
+    OP_BATCH,
+    OP_FORMAT,      // Data is the disk size and block size
+    OP_IMPORT,      // Path is an absolute host path, data is the destination
+    OP_EXPORT,      // Path is on the disk, data is an absolute host path or "-"
+    OP_WRITE_FD,    // The descriptor to read the data from follows the request
+    OP_APPEND_FD,
+    OP_SHUTDOWN,
+
+    OP_COUNT
+};
+
+// A request is followed by path_size bytes of path and data_size bytes of data
+struct Request {
+    unsigned int op;
+    unsigned int path_size;
+    unsigned long data_size;
+};
+
+// A response is followed by size bytes of output, including any error message
+struct Response {
+    int status;
+    unsigned int reserved;
+    unsigned long size;
+};
+
+const char* get_socket_path();
+
+int read_full(int fd, void* buffer, unsigned long size);
+
+int write_full(int fd, const void* buffer, unsigned long size);
+
+int send_fd(int socket, int fd);
+
+int receive_fd(int socket);
+
+int serve(const char* socket_path, const char* disk_path);
+
+#endif
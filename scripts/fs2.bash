@@ -11,6 +11,7 @@ _fs2()
 	cur="${COMP_WORDS[COMP_CWORD]}"
 	prev="${COMP_WORDS[COMP_CWORD-1]}"
 	options="$(fs2 -o)"
+	# Goes through a running 'fs2 --serve' by itself, so completing doesn't load the disk
 	file_list="$(fs2 -l)"
 
 	if [[ ${cur} == -* ]] ; then
@@ -3,24 +3,34 @@
 # generate_sample_disk.bash
 # run this script to create a few sample files on a disk
 
+# Escape file contents for a batch line (see src/batch.c)
+function escape() {
+	local data="$1"
+	data="${data//\\/\\\\}"
+	data="${data//$'\n'/\\n}"
+	data="${data//$'\t'/\\t}"
+	echo "${data}"
+}
+
 function start() {
 	local program_name=fs2
 	./${program_name}
 	info_file='data.txt'
-	./${program_name} -c ${info_file}
 	shopt -s dotglob
 	shopt -s nullglob
 	files=(./scripts/sample/*)
-	for file in ${files[@]}; do
-		./${program_name} -a ${info_file} ${file}"
-"	# To add a newline
-		if [ -d $file ]; then
-			./${program_name} -d "$(basename "$file")"
-		elif [ -f $file ]; then
-			./${program_name} -w "$(basename "$file")" "$(cat ${file})"
-		fi
-	done
+	{
+		echo "create ${info_file}"
+		for file in ${files[@]}; do
+			echo "append ${info_file} $(escape "${file}")\\n"	# To add a newline
+			if [ -d $file ]; then
+				echo "mkdir $(basename "$file")"
+			elif [ -f $file ]; then
+				echo "write $(basename "$file") $(escape "$(cat ${file})")"
+			fi
+		done
+	} | ./${program_name} --batch -
 }
 
 
-start
\ No newline at end of file
+start
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+
+# test_convert.bash
+# run this script to convert a disk of the original layout and check its files
+# scripts/test/original.disk was written by the first version of fs2. Its working directory is
+# /root/sub, and long.txt spans several blocks and was appended to
+
+set -o pipefail
+
+function fail() {
+	echo "convert test failed: $1"
+	exit 1
+}
+
+# Run fs2 and drop its colors
+function run() {
+	"${program}" "$@" | sed 's/\x1b\[[0-9;]*m//g'
+}
+
+function check() {
+	local expected="$1"
+	shift
+	local actual="$(run "$@")"
+	if [ "${actual}" != "${expected}" ]; then
+		fail "fs2 $* printed '${actual}', expected '${expected}'"
+	fi
+}
+
+function start() {
+	local root="$(pwd)"
+	program="${root}/fs2"
+	local dir="$(mktemp -d)"
+	trap "rm -rf '${dir}'" EXIT
+	mkdir -p "${dir}/data" "${dir}/log"
+	cp "${root}/scripts/test/original.disk" "${dir}/data/test.disk"
+	cd "${dir}"
+
+	run --convert > /dev/null || fail "--convert exited with an error"
+	check "/root/sub" --pwd
+	check "inside sub" --read inner
+	check "/root/sub/deeper" --change-dir deeper --pwd
+	run --change-dir ../.. > /dev/null
+	check "hello world" --read hello.txt
+	check "The quick brown fox jumps over the lazy dog, again and again and again. More." --read long.txt
+	# The removed file must not come back
+	[ "$(run --list | grep -c gone)" == "0" ] || fail "removed file 'gone' was converted"
+	check "Disk already uses layout version 2" --convert
+	echo "convert test passed"
+}
+
+
+start
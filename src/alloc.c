@@ -4,57 +4,466 @@
 #include "block.h"
 #include "file.h"
 #include "alloc.h"
+#include "index.h"
+#include "dir.h"
+#include "dir_index.h"
+#include "dentry.h"
+#include "disk.h"
+
+#define UNIT_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+// Overlay for freed data blocks and file headers, linked into the free list of their size class
+struct Free_slot {
+    char block_type;    // BLOCK_FREE, BLOCK_FILE_HEADER_FREE
+    addr_t next;
+};
+
+// Maximum number of separate extents a single allocate_blocks() call is split into
+#define MAX_EXTENTS 8
+
+struct Extent {
+    unsigned long unit;     // First allocation unit of the extent
+    unsigned long count;    // Number of data blocks in the extent
+};
+
+// Every segment of the disk has two zones in the bitmap: the heap, which everything but
+// data blocks is allocated from, and the block table. The data region after the table is
+// implied by it
+enum Zones {
+    ZONE_HEAP,
+    ZONE_BLOCKS
+};
+
+static unsigned long units_of(unsigned long size);
+static unsigned long* get_bitmap();
+static void get_zone(int zone, const struct Disk_segment* segment, unsigned long* from, unsigned long* to);
+static int zone_of(unsigned long unit);
+static void layout_segment(struct Disk_segment* segment, unsigned long start, unsigned long end);
+static int add_segment(const struct Disk_segment* segment);
+static int grow_disk(int zone, unsigned long count);
+static int is_unit_used(const unsigned long* bitmap, unsigned long unit);
+static void mark_units(unsigned long from, unsigned long count, int used);
+static unsigned long find_free_units(unsigned long from, unsigned long to, unsigned long count);
+static unsigned long find_largest_free_run(int zone, unsigned long max_count, unsigned long* length);
+static unsigned long claim_units(int zone, unsigned long count);
+static void release_units(unsigned long unit, unsigned long count);
+static void* pop_free_slot(addr_t* head, unsigned long* count, unsigned long size);
+static void push_free_slot(addr_t* head, unsigned long* count, unsigned long addr, char block_type);
+
+unsigned long units_of(unsigned long size) {
+    return (size + ALLOC_UNIT - 1) / ALLOC_UNIT;
+}
+
+unsigned long* get_bitmap() {
+    return get_ptr(get_state()->disk_header->bitmap);
+}
+
+// Assign the first unit of the zone of the segment to from, and the unit after it to to
+void get_zone(int zone, const struct Disk_segment* segment, unsigned long* from, unsigned long* to) {
+    *from = zone == ZONE_HEAP ? segment->start / ALLOC_UNIT : segment->block_table / ALLOC_UNIT;
+    *to = zone == ZONE_HEAP ? segment->block_table / ALLOC_UNIT : segment->block_data / ALLOC_UNIT;
+}
+
+int zone_of(unsigned long unit) {
+    return unit < get_segment(unit * ALLOC_UNIT)->block_table / ALLOC_UNIT ? ZONE_HEAP : ZONE_BLOCKS;
+}
+
+// Split [start, end) into the heap and the block zone. Blocks take BLOCK_ZONE_PERCENT of it,
+// with their data at the end, aligned to BLOCK_DATA_ALIGN
+void layout_segment(struct Disk_segment* segment, unsigned long start, unsigned long end) {
+    unsigned long block_size = get_block_size();
+    segment->magic = SEGMENT_MAGIC;
+    segment->start = start;
+    segment->end = end;
+    segment->block_count = (end - start) / 100 * BLOCK_ZONE_PERCENT / TOTAL_BLOCK_SIZE;
+    segment->block_data = (end - segment->block_count * block_size) & ~(unsigned long)(BLOCK_DATA_ALIGN - 1);
+    segment->block_table = segment->block_data - segment->block_count * sizeof(struct Data_block);
+}
+
+int add_segment(const struct Disk_segment* segment) {
+    struct FS_state* state = get_state();
+    struct Disk_segment* segments = realloc(state->segments, (state->segment_count + 1) * sizeof(struct Disk_segment));
+    if (!segments) {
+        error("Failed to allocate memory for disk segments\n");
+        return -1;
+    }
+    segments[state->segment_count++] = *segment;
+    state->segments = segments;
+    state->total_blocks += segment->block_count;
+    return 0;
+}
+
+int is_unit_used(const unsigned long* bitmap, unsigned long unit) {
+    return (bitmap[unit / UNIT_BITS] >> (unit % UNIT_BITS)) & 1;
+}
+
+void mark_units(unsigned long from, unsigned long count, int used) {
+    unsigned long* bitmap = get_bitmap();
+    for (unsigned long unit = from; unit < from + count; unit++) {
+        if (used)
+            bitmap[unit / UNIT_BITS] |= (1UL << (unit % UNIT_BITS));
+        else
+            bitmap[unit / UNIT_BITS] &= ~(1UL << (unit % UNIT_BITS));
+    }
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long* free_units = zone_of(from) == ZONE_HEAP ? &header->free_units : &header->free_table_units;
+    if (used)
+        *free_units -= count;
+    else
+        *free_units += count;
+
+    unsigned long first_word = from / UNIT_BITS;
+    unsigned long last_word = (from + count - 1) / UNIT_BITS;
+    mark_dirty(&bitmap[first_word], (last_word - first_word + 1) * sizeof(unsigned long));
+    mark_dirty(get_state()->disk_header, sizeof(struct FS_disk_header));
+}
+
+// Search [from, to) for a run of free units, skipping words that are completely used
+// Returns the first unit of the run, or 0 if there is none (unit 0 always belongs to the disk header)
+unsigned long find_free_units(unsigned long from, unsigned long to, unsigned long count) {
+    const unsigned long* bitmap = get_bitmap();
+    unsigned long run = 0;
+    for (unsigned long unit = from; unit < to;) {
+        if (run == 0 && (unit % UNIT_BITS) == 0 && bitmap[unit / UNIT_BITS] == ~0UL) {
+            unit += UNIT_BITS;
+            continue;
+        }
+        if (is_unit_used(bitmap, unit)) {
+            run = 0;
+        }
+        else if (++run == count) {
+            return unit + 1 - count;
+        }
+        unit++;
+    }
+    return 0;
+}
+
+// Split the disk into the heap and the block zone, then place the free-space bitmap right
+// after the disk header and reserve both
+int allocator_init() {
+    struct FS_disk_header* header = get_state()->disk_header;
+    struct Disk_segment segment;
+    layout_segment(&segment, 0, header->disk_size);
+    header->block_count = segment.block_count;
+    header->block_data = segment.block_data;
+    header->block_table = segment.block_table;
+    if (allocator_load() != 0) {
+        return -1;
+    }
+
+    unsigned long heap_units = header->block_table / ALLOC_UNIT;
+    unsigned long unit_count = header->block_data / ALLOC_UNIT;
+    header->bitmap = units_of(sizeof(struct FS_disk_header)) * ALLOC_UNIT;
+    header->bitmap_size = ((unit_count + UNIT_BITS - 1) / UNIT_BITS) * sizeof(unsigned long);
+    unsigned long reserved = units_of(header->bitmap + header->bitmap_size);
+    if (header->block_count == 0 || reserved >= heap_units) {
+        error("Disk is too small (" COLOR_NUMBERS "%lu" NONE " bytes)\n", header->disk_size);
+        return -1;
+    }
+    flush(header->bitmap, header->bitmap + header->bitmap_size);
+    header->free_units = heap_units;
+    header->free_table_units = unit_count - heap_units;
+    mark_units(0, reserved, 1);
+    header->next_free = reserved;
+    header->next_free_block = heap_units;
+    return 0;
+}
+
+// Find the segments of the disk, starting with the one described by the disk header
+int allocator_load() {
+    struct FS_state* state = get_state();
+    struct FS_disk_header* header = state->disk_header;
+    allocator_free();
+
+    struct Disk_segment segment = {
+        .magic = SEGMENT_MAGIC,
+        .start = 0,
+        .end = header->block_data + header->block_count * header->block_size,
+        .block_table = header->block_table,
+        .block_count = header->block_count,
+        .block_data = header->block_data
+    };
+    while (1) {
+        if (add_segment(&segment) != 0) {
+            return -1;
+        }
+        unsigned long start = units_of(segment.end) * ALLOC_UNIT;
+        const struct Disk_segment* next = get_ptr(start);
+        if (!next || start + sizeof(struct Disk_segment) > header->disk_size || next->magic != SEGMENT_MAGIC) {
+            break;
+        }
+        if (next->start != start || next->end > header->disk_size || next->block_table < start ||
+            next->block_data < next->block_table + next->block_count * sizeof(struct Data_block) ||
+            next->block_data + next->block_count * header->block_size > next->end) {
+            error("Invalid disk segment at address " COLOR_NUMBERS "%lu" NONE "\n", start);
+            return -1;
+        }
+        segment = *next;
+    }
+    return 0;
+}
+
+void allocator_free() {
+    struct FS_state* state = get_state();
+    free(state->segments);
+    state->segments = NULL;
+    state->segment_count = 0;
+    state->total_blocks = 0;
+}
+
+// Get the segment that address is in
+const struct Disk_segment* get_segment(unsigned long address) {
+    struct FS_state* state = get_state();
+    // Segments get larger as the disk grows, so most addresses are in the last ones
+    unsigned long n = state->segment_count;
+    while (n > 1 && address < state->segments[n - 1].start) {
+        n--;
+    }
+    return &state->segments[n - 1];
+}
+
+// Add a segment at the end of the disk that has room for at least count units in the zone.
+// It's at least as large as the disk already is, so the number of segments stays small.
+// The bitmap moves to the start of its heap, since it has to cover the new units
+int grow_disk(int zone, unsigned long count) {
+    struct FS_state* state = get_state();
+    struct FS_disk_header* header = state->disk_header;
+    const struct Disk_segment* last = &state->segments[state->segment_count - 1];
+    unsigned long start = units_of(last->end) * ALLOC_UNIT;
+    unsigned long bitmap = start + units_of(sizeof(struct Disk_segment)) * ALLOC_UNIT;
+    unsigned long bitmap_size = 0;
+
+    struct Disk_segment segment;
+    for (unsigned long size = header->disk_size; ; size *= 2) {
+        unsigned long end = (start + size + BLOCK_DATA_ALIGN - 1) & ~(unsigned long)(BLOCK_DATA_ALIGN - 1);
+        if (end > state->reserved_size) {
+            return -1;
+        }
+        layout_segment(&segment, start, end);
+        bitmap_size = ((segment.block_data / ALLOC_UNIT + UNIT_BITS - 1) / UNIT_BITS) * sizeof(unsigned long);
+        unsigned long heap_from = units_of(bitmap + bitmap_size);
+        unsigned long heap_to = segment.block_table / ALLOC_UNIT;
+        if (heap_to <= heap_from) {
+            continue;
+        }
+        unsigned long room = zone == ZONE_HEAP ? heap_to - heap_from : (segment.block_data - segment.block_table) / ALLOC_UNIT;
+        if (room >= count) {
+            break;
+        }
+    }
+    if (extend_disk(segment.end) != 0) {
+        return -1;
+    }
+    header->disk_size = segment.end;
+
+    struct Disk_segment* descriptor = get_ptr(start);
+    *descriptor = segment;
+    mark_dirty(descriptor, sizeof(struct Disk_segment));
+    if (add_segment(&segment) != 0) {
+        return -1;
+    }
+
+    unsigned long old_bitmap = header->bitmap;
+    unsigned long old_bitmap_size = header->bitmap_size;
+    memcpy(get_ptr(bitmap), get_bitmap(), old_bitmap_size);
+    header->bitmap = bitmap;
+    header->bitmap_size = bitmap_size;
+    mark_dirty(get_ptr(bitmap), bitmap_size);
+
+    header->free_units += (segment.block_table - start) / ALLOC_UNIT;
+    header->free_table_units += (segment.block_data - segment.block_table) / ALLOC_UNIT;
+    mark_units(start / ALLOC_UNIT, units_of(bitmap + bitmap_size) - start / ALLOC_UNIT, 1);
+    flush(old_bitmap, old_bitmap + old_bitmap_size);
+    release_units(old_bitmap / ALLOC_UNIT, units_of(old_bitmap_size));
+
+    fslog("Grew disk to %lu bytes (%lu blocks)\n", header->disk_size, state->total_blocks);
+    return 0;
+}
+
+// Take a slot from a size class free list, falling back to the bitmap when the list is empty
+void* pop_free_slot(addr_t* head, unsigned long* count, unsigned long size) {
+    struct Free_slot* slot = get_ptr(*head);
+    if (!slot) {
+        return allocate(size);
+    }
+    *head = slot->next;
+    (*count)--;
+    mark_dirty(get_state()->disk_header, sizeof(struct FS_disk_header));
+    flush(get_absolute_address(slot), get_absolute_address(slot) + size);
+    return slot;
+}
+
+void push_free_slot(addr_t* head, unsigned long* count, unsigned long addr, char block_type) {
+    struct Free_slot* slot = get_ptr(addr);
+    slot->block_type = block_type;
+    slot->next = *head;
+    *head = addr;
+    (*count)++;
+    mark_dirty(slot, sizeof(struct Free_slot));
+    mark_dirty(get_state()->disk_header, sizeof(struct FS_disk_header));
+}
+
+// Find the longest run of free units in the zone, but stop looking once a run of max_count units is found
+unsigned long find_largest_free_run(int zone, unsigned long max_count, unsigned long* length) {
+    const unsigned long* bitmap = get_bitmap();
+    unsigned long best = 0;
+    *length = 0;
+    for (unsigned long n = 0; n < get_state()->segment_count && *length < max_count; n++) {
+        unsigned long from, to;
+        get_zone(zone, &get_state()->segments[n], &from, &to);
+        unsigned long run = 0;
+        for (unsigned long unit = from; unit < to;) {
+            if (run == 0 && (unit % UNIT_BITS) == 0 && bitmap[unit / UNIT_BITS] == ~0UL) {
+                unit += UNIT_BITS;
+                continue;
+            }
+            if (is_unit_used(bitmap, unit)) {
+                run = 0;
+            }
+            else if (++run > *length) {
+                best = unit + 1 - run;
+                *length = run;
+                if (run == max_count) {
+                    break;
+                }
+            }
+            unit++;
+        }
+    }
+    return best;
+}
+
+// Reserve and zero a run of free units of the zone
+// Returns the first unit of the run, or 0 if there isn't enough contiguous space
+unsigned long claim_units(int zone, unsigned long count) {
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long* next_free = zone == ZONE_HEAP ? &header->next_free : &header->next_free_block;
+    unsigned long free_units = zone == ZONE_HEAP ? header->free_units : header->free_table_units;
+    unsigned long from, to;
+
+    if (count == 0 || count > free_units) {
+        return 0;
+    }
+    // Resume from the hint, then look through the zone of every segment from the first one
+    unsigned long unit = 0;
+    get_zone(zone, get_segment(*next_free * ALLOC_UNIT), &from, &to);
+    if (*next_free >= from && *next_free < to) {
+        unit = find_free_units(*next_free, to, count);
+    }
+    for (unsigned long n = 0; !unit && n < get_state()->segment_count; n++) {
+        get_zone(zone, &get_state()->segments[n], &from, &to);
+        unit = find_free_units(from, to, count);
+    }
+    if (!unit) {
+        return 0;
+    }
+    mark_units(unit, count, 1);
+    *next_free = unit + count;
+
+    flush(unit * ALLOC_UNIT, (unit + count) * ALLOC_UNIT);
+    return unit;
+}
+
+void release_units(unsigned long unit, unsigned long count) {
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long* next_free = zone_of(unit) == ZONE_HEAP ? &header->next_free : &header->next_free_block;
+    mark_units(unit, count, 0);
+    if (unit < *next_free) {
+        *next_free = unit;
+    }
+}
+
+unsigned long get_free_space() {
+    if (!is_initialized()) {
+        return 0;
+    }
+    struct FS_disk_header* header = get_state()->disk_header;
+    return header->free_units * ALLOC_UNIT +
+        (header->free_table_units * ALLOC_UNIT / sizeof(struct Data_block) + header->free_block_count) * TOTAL_BLOCK_SIZE +
+        header->free_file_header_count * TOTAL_FILE_HEADER_SIZE;
+}
+
+// Number of bytes the disk can still grow by, which is bounded by the address space
+// reserved for it (at most MAX_DISK_SIZE)
+unsigned long get_growable_space() {
+    if (!is_initialized()) {
+        return 0;
+    }
+    struct FS_state* state = get_state();
+    unsigned long limit = state->reserved_size < MAX_DISK_SIZE ? state->reserved_size : MAX_DISK_SIZE;
+    return limit > state->disk_header->disk_size ? limit - state->disk_header->disk_size : 0;
+}
 
 void flush(unsigned long from, unsigned long to) {
     if (!is_initialized() || from > to || to > get_state()->disk_header->disk_size) {
         return;
     }
 
-    for (unsigned long i = from; i < to; i++) {
-        get_state()->disk[i] = 0;
-    }
+    memset(&get_state()->disk[from], 0, to - from);
+    mark_dirty(&get_state()->disk[from], to - from);
 }
 
 void* allocate(unsigned long size) {
     if (!is_initialized()) {
         return NULL;
     }
-    unsigned long free_space = 0;
-    for (unsigned long i = sizeof(struct FS_disk_header); i < get_state()->disk_header->disk_size; i++) {
-        if (free_space >= size) {
-            flush(i - free_space, i);
-            return (void*)&get_state()->disk[i - free_space];
-        }
-        switch (get_state()->disk[i]) {
-            case BLOCK_USED:
-                i += TOTAL_BLOCK_SIZE;
-                free_space = 0;
-                break;
-
-            case BLOCK_FILE_HEADER:
-                i += TOTAL_FILE_HEADER_SIZE;
-                free_space = 0;
-                break;
-
-            case BLOCK_FREE: {
-                free_space += TOTAL_BLOCK_SIZE;
-                i += TOTAL_BLOCK_SIZE;
-            }
-                break;
+    unsigned long unit = claim_units(ZONE_HEAP, units_of(size));
+    if (!unit && grow_disk(ZONE_HEAP, units_of(size)) == 0) {
+        unit = claim_units(ZONE_HEAP, units_of(size));
+    }
+    if (!unit) {
+        error("Failed to allocate memory. Disk is full\n");
+        return NULL;
+    }
+    return get_ptr(unit * ALLOC_UNIT);
+}
 
-            case BLOCK_FILE_HEADER_FREE: {
-                free_space += TOTAL_FILE_HEADER_SIZE;
-                i += TOTAL_FILE_HEADER_SIZE;
-            }
-                break;
+// Reserve count blocks next to each other in the block table, linked in order. The disk
+// grows when there is no free run that long
+// Returns the first one, or NULL if the disk can't grow enough (which isn't reported as an error)
+struct Data_block* try_allocate_blocks(unsigned long count) {
+    if (!is_initialized() || count == 0) {
+        return NULL;
+    }
+    unsigned long units = count * units_of(sizeof(struct Data_block));
+    unsigned long unit = claim_units(ZONE_BLOCKS, units);
+    if (!unit && grow_disk(ZONE_BLOCKS, units) == 0) {
+        unit = claim_units(ZONE_BLOCKS, units);
+    }
+    if (!unit) {
+        return NULL;
+    }
+    struct Data_block* blocks = get_ptr(unit * ALLOC_UNIT);
+    for (unsigned long n = 0; n < count; n++) {
+        blocks[n].block_type = BLOCK_USED;
+        blocks[n].next = n + 1 < count ? get_absolute_address(&blocks[n + 1]) : 0;
+    }
+    return blocks;
+}
 
-            default:
-                free_space++;
-                break;
-        }
+// Give the slots kept on the free lists back to the bitmap, so that they can become part of larger runs
+void release_free_lists() {
+    if (!is_initialized()) {
+        return;
+    }
+    struct FS_disk_header* header = get_state()->disk_header;
+    struct Free_slot* slot = NULL;
+    while ((slot = get_ptr(header->free_blocks))) {
+        unsigned long addr = header->free_blocks;
+        header->free_blocks = slot->next;
+        flush(addr, addr + sizeof(struct Free_slot));
+        release_units(addr / ALLOC_UNIT, units_of(sizeof(struct Data_block)));
     }
-    error("Failed to allocate memory. Disk is full\n");
-    return NULL;
+    while ((slot = get_ptr(header->free_file_headers))) {
+        unsigned long addr = header->free_file_headers;
+        header->free_file_headers = slot->next;
+        flush(addr, addr + sizeof(struct Free_slot));
+        release_units(addr / ALLOC_UNIT, units_of(TOTAL_FILE_HEADER_SIZE));
+    }
+    header->free_block_count = 0;
+    header->free_file_header_count = 0;
+    mark_dirty(header, sizeof(struct FS_disk_header));
 }
 
 struct FSFILE* allocate_file(const char* path, int file_type) {
@@ -74,12 +483,13 @@ struct FSFILE* allocate_file(const char* path, int file_type) {
 
     unsigned long id = hash2(path);
     addr_t empty_slot_addr = 0;
-    if ((find_file(NULL, id, NULL, &empty_slot_addr))) {
+    if ((find_file(NULL, id, path, NULL, &empty_slot_addr))) {
         error(COLOR_MESSAGE "'%s'" NONE " File already exists\n", path);
         return NULL;
     }
 
-    struct FSFILE* file = allocate(TOTAL_FILE_HEADER_SIZE);
+    struct FS_disk_header* header = get_state()->disk_header;
+    struct FSFILE* file = pop_free_slot(&header->free_file_headers, &header->free_file_header_count, TOTAL_FILE_HEADER_SIZE);
 
     if (file) {
         file->block_type = BLOCK_FILE_HEADER;
@@ -87,41 +497,124 @@ struct FSFILE* allocate_file(const char* path, int file_type) {
         file->id = id;
         file->type = file_type;
         file->first_block = 0;
+        file->last_block = 0;
+        file->dir_index = 0;
+        file->dead_entries = 0;
+        mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
 
         if (dir) {
-            unsigned long file_addr = get_absolute_address(file);
-            unsigned long* empty_slot = get_ptr(empty_slot_addr);
-            if (empty_slot != NULL)
-                *empty_slot = file_addr;
-            else
-                write_data(&file_addr, sizeof(unsigned long), dir);
+            dentry_invalidate(get_absolute_address(dir), id, path);
+            struct Dir_entry entry = { .id = id, .type = file_type, .file = get_absolute_address(file) };
+            struct Dir_entry* empty_slot = get_ptr(empty_slot_addr);
+            if (empty_slot != NULL) {
+                *empty_slot = entry;
+                mark_dirty(empty_slot, sizeof(struct Dir_entry));
+                dir->dead_entries--;
+                mark_dirty(dir, TOTAL_FILE_HEADER_SIZE);
+            }
+            else if (write_data(&entry, sizeof(struct Dir_entry), dir) == 0) {
+                // Entries never straddle blocks, so the new one ends the last block
+                struct Data_block* last = get_ptr(dir->last_block);
+                empty_slot = (struct Dir_entry*)(get_block_data(last) + last->bytes_used - sizeof(struct Dir_entry));
+            }
+            if (empty_slot != NULL) {
+                if (dir->dir_index)
+                    dir_index_insert(dir, id, get_absolute_address(empty_slot));
+                else if (!dir->unindexed && dir->size / sizeof(struct Dir_entry) >= DIR_INDEX_THRESHOLD)
+                    dir_index_build(dir);
+            }
         }
     }
 
     return file;
 }
 
-struct Data_block* allocate_blocks(int count) {
+// Reserve count blocks of the block table as one contiguous extent when possible, otherwise
+// as a few smaller extents, and use the free list for whatever is left. The blocks are linked
+// in order and the last one is assigned to (struct Data_block** last)
+struct Data_block* allocate_blocks(int count, struct Data_block** last) {
     if (!is_initialized() || count <= 0) {
         return NULL;
     }
 
-    struct Data_block* block = allocate(TOTAL_BLOCK_SIZE);
-    if (!block) {
-        return NULL;
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long block_units = units_of(sizeof(struct Data_block));
+    struct Extent extents[MAX_EXTENTS];
+    int extent_count = 0;
+    unsigned long remaining = count;
+
+    // A single block is cheapest to take from the free list
+    if (count > 1 || header->free_blocks == 0) {
+        unsigned long unit = claim_units(ZONE_BLOCKS, remaining * block_units);
+        if (unit) {
+            extents[extent_count++] = (struct Extent) {unit, remaining};
+            remaining = 0;
+        }
+        while (remaining > 0 && extent_count < MAX_EXTENTS) {
+            unsigned long length = 0;
+            unit = find_largest_free_run(ZONE_BLOCKS, remaining * block_units, &length);
+            length /= block_units;
+            if (length == 0) {
+                break;
+            }
+            mark_units(unit, length * block_units, 1);
+            flush(unit * ALLOC_UNIT, unit * ALLOC_UNIT + length * sizeof(struct Data_block));
+            extents[extent_count++] = (struct Extent) {unit, length};
+            remaining -= length;
+        }
     }
 
-    block->block_type = BLOCK_USED;
-    block->bytes_used = 0;
-    struct Data_block* next = allocate_blocks(count - 1);
-    if (next != NULL) {
-        block->next = get_absolute_address(next);
+    // Whatever the free list can't cover comes from a new segment. If there's no extent left
+    // for it, the whole allocation does
+    if (remaining > header->free_block_count) {
+        if (extent_count == MAX_EXTENTS) {
+            for (int i = 0; i < extent_count; i++) {
+                release_units(extents[i].unit, extents[i].count * block_units);
+            }
+            extent_count = 0;
+            remaining = count;
+        }
+        unsigned long unit = 0;
+        if (grow_disk(ZONE_BLOCKS, remaining * block_units) == 0 &&
+            (unit = claim_units(ZONE_BLOCKS, remaining * block_units))) {
+            extents[extent_count++] = (struct Extent) {unit, remaining};
+            remaining = 0;
+        }
+    }
+
+    if (remaining > header->free_block_count) {
+        for (int i = 0; i < extent_count; i++) {
+            release_units(extents[i].unit, extents[i].count * block_units);
+        }
+        error("Failed to allocate " COLOR_NUMBERS "%i" NONE " blocks. Disk is full\n", count);
+        return NULL;
     }
-    else {
-        block->next = 0;
+
+    struct Data_block* first = NULL;
+    struct Data_block* tail = NULL;
+    for (int i = 0; i < extent_count + 1; i++) {
+        unsigned long blocks = (i < extent_count) ? extents[i].count : remaining;
+        for (unsigned long j = 0; j < blocks; j++) {
+            struct Data_block* block = NULL;
+            if (i < extent_count)
+                block = get_ptr(extents[i].unit * ALLOC_UNIT + j * sizeof(struct Data_block));
+            else
+                block = pop_free_slot(&header->free_blocks, &header->free_block_count, sizeof(struct Data_block));
+
+            block->block_type = BLOCK_USED;
+            block->bytes_used = 0;
+            block->next = 0;
+            if (tail)
+                tail->next = get_absolute_address(block);
+            else
+                first = block;
+            tail = block;
+        }
     }
 
-    return block;
+    if (last)
+        *last = tail;
+    return first;
 }
 
 int deallocate_file(struct FSFILE* file) {
@@ -129,13 +622,18 @@ int deallocate_file(struct FSFILE* file) {
         return -1;
     }
 
+    dir_index_free(file);
+
     if (!can_access_address(file->first_block)) {
         return 0;
     }
 
+    free_file_index(file);
     deallocate_blocks(file->first_block);
     file->first_block = 0;
+    file->last_block = 0;
     file->size = 0;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
     return 0;
 }
 
@@ -143,17 +641,13 @@ int deallocate_blocks(unsigned long addr) {
     if (!can_access_address(addr)) {
         return -1;
     }
-    
-    struct Data_block* block = get_ptr(addr);
-    unsigned long next = block->next;
 
-    int err = free_block(addr, TOTAL_BLOCK_SIZE, BLOCK_USED);
-    if (err != 0) {
-        return err;
-    }
-    
-    if (can_access_address(next)) {
-        deallocate_blocks(next);
+    struct Block_cursor cursor;
+    for (struct Data_block* block = cursor_start(&cursor, addr); block; block = cursor_next(&cursor)) {
+        int err = free_block(cursor.address, sizeof(struct Data_block), BLOCK_USED);
+        if (err != 0) {
+            return err;
+        }
     }
     return 0;
 }
@@ -171,5 +665,18 @@ int free_block(unsigned long block_addr, unsigned long block_size, char verify_b
     }
 
     flush(block_addr, block_addr + block_size);
+
+    // Data blocks and file headers are kept in their own size class
+    struct FS_disk_header* header = get_state()->disk_header;
+    if (block_type == BLOCK_USED && block_size == sizeof(struct Data_block)) {
+        push_free_slot(&header->free_blocks, &header->free_block_count, block_addr, BLOCK_FREE);
+        return 0;
+    }
+    if (block_type == BLOCK_FILE_HEADER && block_size == TOTAL_FILE_HEADER_SIZE) {
+        push_free_slot(&header->free_file_headers, &header->free_file_header_count, block_addr, BLOCK_FILE_HEADER_FREE);
+        return 0;
+    }
+
+    release_units(block_addr / ALLOC_UNIT, units_of(block_size));
     return 0;
 }
\ No newline at end of file
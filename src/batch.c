@@ -0,0 +1,155 @@
+// batch.c
+// Runs a stream of operations against the loaded disk, one per line:
+//
+//   create <file>          mkdir <dir>        cd <dir>
+//   write <file> <data>    append <file> <data>
+//   read <file>            info <file>        rm <file>
+//   ls [dir]               pwd
+//
+// Data is the rest of the line, where \n, \t, \0 and \\ are unescaped.
+// Empty lines and lines starting with '#' are skipped
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs2.h"
+#include "error.h"
+#include "batch.h"
+
+static char* next_token(char** line);
+static unsigned long unescape(char* str);
+static int write_file(const char* path, const char* mode, char* data);
+static int run_command(char* line, FILE* output);
+
+// Split off the next word of the line, NULL if there is none
+char* next_token(char** line) {
+    char* start = *line;
+    while (*start == ' ' || *start == '\t')
+        start++;
+    if (*start == '\0') {
+        *line = start;
+        return NULL;
+    }
+    char* end = start;
+    while (*end != '\0' && *end != ' ' && *end != '\t')
+        end++;
+    if (*end != '\0')
+        *end++ = '\0';
+    *line = end;
+    return start;
+}
+
+// Unescape in place. Returns the length, since the result may contain null bytes
+unsigned long unescape(char* str) {
+    unsigned long length = 0;
+    for (char* c = str; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+            switch (*c) {
+                case 'n': str[length++] = '\n'; break;
+                case 't': str[length++] = '\t'; break;
+                case '0': str[length++] = '\0'; break;
+                default:  str[length++] = *c; break;
+            }
+            continue;
+        }
+        str[length++] = *c;
+    }
+    return length;
+}
+
+int write_file(const char* path, const char* mode, char* data) {
+    FSFILE* file = fs_open(path, mode);
+    if (!file) {
+        return -1;
+    }
+    int result = 0;
+    if (data) {
+        result = fs_write(data, unescape(data), file);
+    }
+    fs_close(file);
+    return result;
+}
+
+int run_command(char* line, FILE* output) {
+    char* command = next_token(&line);
+    if (!command || *command == '#') {
+        return 0;
+    }
+    char* path = next_token(&line);
+    // Data starts after the single space that follows the path
+    char* data = (path && *line != '\0') ? line : NULL;
+
+    if (strcmp(command, "pwd") == 0) {
+        return fs_pwd(output);
+    }
+    if (strcmp(command, "ls") == 0) {
+        return fs_list(path, output);
+    }
+    if (!path) {
+        error("'%s' needs a path\n", command);
+        return -1;
+    }
+
+    if (strcmp(command, "create") == 0) {
+        return write_file(path, "w", NULL);
+    }
+    if (strcmp(command, "write") == 0) {
+        return write_file(path, "w", data);
+    }
+    if (strcmp(command, "append") == 0) {
+        return write_file(path, "a", data);
+    }
+    if (strcmp(command, "read") == 0 || strcmp(command, "info") == 0) {
+        FSFILE* file = fs_open(path, "r");
+        if (!file) {
+            return -1;
+        }
+        int result = 0;
+        if (command[0] == 'r')
+            result = fs_read(file, output);
+        else
+            fs_print_file_info(file, output);
+        fs_close(file);
+        return result;
+    }
+    if (strcmp(command, "rm") == 0) {
+        return fs_remove_file(path);
+    }
+    if (strcmp(command, "mkdir") == 0) {
+        FSFILE* dir = fs_create_dir(path);
+        fs_close(dir);
+        return dir ? 0 : -1;
+    }
+    if (strcmp(command, "cd") == 0) {
+        return fs_change_dir(path);
+    }
+    error("Unknown command '%s'\n", command);
+    return -1;
+}
+
+// Returns the number of lines that failed
+int run_batch(FILE* input, FILE* output) {
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    unsigned long line_number = 0;
+    int failed = 0;
+
+    while ((length = getline(&line, &capacity, input)) != -1) {
+        line_number++;
+        if (length > 0 && line[length - 1] == '\n')
+            line[length - 1] = '\0';
+
+        if (run_command(line, output) != 0 || is_error()) {
+            failed++;
+            fprintf(output, "Line %lu: ", line_number);
+            get_error(output);
+        }
+    }
+    free(line);
+    return failed;
+}
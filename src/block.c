@@ -5,17 +5,71 @@
 
 #include "block.h"
 #include "file_system.h"
+#include "alloc.h"
+
+static struct Data_block* cursor_move(struct Block_cursor* cursor, unsigned long block_addr);
+
+unsigned long get_block_size() {
+    return get_state()->disk_header->block_size;
+}
+
+// The data of the block at index n of a block table is at index n of the data region after it
+char* get_block_data(const struct Data_block* block) {
+    unsigned long address = get_absolute_address(block);
+    const struct Disk_segment* segment = get_segment(address);
+    unsigned long index = (address - segment->block_table) / sizeof(struct Data_block);
+    return get_state()->disk + segment->block_data + index * get_block_size();
+}
+
+// Move the cursor onto the block at block_addr (0 ends the chain)
+struct Data_block* cursor_move(struct Block_cursor* cursor, unsigned long block_addr) {
+    cursor->block = NULL;
+    cursor->address = block_addr;
+    cursor->next = 0;
+    if (block_addr == 0) {
+        return NULL;
+    }
+    struct Data_block* block = get_ptr(block_addr);
+    if (!block || block->block_type != BLOCK_USED || cursor->steps >= cursor->limit) {
+        error("Broken block chain at address " COLOR_NUMBERS "%lu" NONE "\n", block_addr);
+        return NULL;
+    }
+    cursor->block = block;
+    cursor->next = block->next;
+    cursor->steps++;
+    prefetch(get_ptr(cursor->next));
+    return block;
+}
+
+struct Data_block* cursor_start(struct Block_cursor* cursor, unsigned long block_addr) {
+    cursor->steps = 0;
+    cursor->limit = is_initialized() ? get_state()->total_blocks : 0;
+    return cursor_move(cursor, block_addr);
+}
+
+struct Data_block* cursor_next(struct Block_cursor* cursor) {
+    if (!cursor->block) {
+        return NULL;
+    }
+    return cursor_move(cursor, cursor->next);
+}
 
 void print_block_info(struct Data_block* block, FILE* output) {
     if (!block) {
         fprintf(output, "Invalid block (block is NULL)\n");
         return;
     }
-    char* block_info[] = {
+    char* block_info[BLOCK_TYPES_COUNT] = {
         "-",
         "BLOCK_USED",
-        "BLOCK_FREE"
+        "BLOCK_FREE",
+        "BLOCK_FILE_HEADER",
+        "BLOCK_FILE_HEADER_FREE",
+        "BLOCK_INDEX",
+        "BLOCK_DIR_INDEX",
+        "BLOCK_DIR_BUCKET"
     };
+    int type = block->block_type;
     fprintf(output,
         "struct Data_block {\n"
         "   type: %s\n"
@@ -24,38 +78,33 @@ void print_block_info(struct Data_block* block, FILE* output) {
         "   next: %lu\n"
         "}\n"
         ,
-        block_info[(int)block->block_type],
+        type >= 0 && type < BLOCK_TYPES_COUNT ? block_info[type] : "unknown",
         7,
-        block->data,
+        get_block_data(block),
         block->bytes_used,
         block->next
     );
 }
 
 int count_blocks(struct Data_block* block) {
-    if (!block) {
-        return 0;
-    }
-    if (block->next == 0) {
-        return 1;
-    }
-    struct Data_block* next = (struct Data_block*)get_ptr(block->next);
-    if (next) {
-        return count_blocks(next) + 1;
+    struct Block_cursor cursor;
+    int count = 0;
+    for (block = cursor_start(&cursor, block ? get_absolute_address(block) : 0); block; block = cursor_next(&cursor)) {
+        count++;
     }
-    return 0;
+    return count;
 }
 
 int get_size_of_blocks(unsigned long block_addr) {
 	if (!can_access_address(block_addr)) {
 		return -1;
 	}
-    struct Data_block* block = get_ptr(block_addr);
-    if (block->next == 0) {
-        return block->bytes_used;
+    struct Block_cursor cursor;
+    int size = 0;
+    for (struct Data_block* block = cursor_start(&cursor, block_addr); block; block = cursor_next(&cursor)) {
+        size += block->bytes_used;
     }
-
-    return get_size_of_blocks(block->next) + block->bytes_used;
+    return size;
 }
 
 struct Data_block* read_block(unsigned long block_addr) {
@@ -71,15 +120,10 @@ struct Data_block* read_block(unsigned long block_addr) {
 }
 
 struct Data_block* get_last_block(struct Data_block* block) {
-    if (!block) {
-        return NULL;
+    struct Block_cursor cursor;
+    struct Data_block* last = NULL;
+    for (block = cursor_start(&cursor, block ? get_absolute_address(block) : 0); block; block = cursor_next(&cursor)) {
+        last = block;
     }
-    if (block->next == 0) {
-        return block;
-    }
-    struct Data_block* next = (struct Data_block*)get_ptr(block->next);
-    if (next) {
-        return get_last_block(next);
-    }
-    return NULL;
-}
\ No newline at end of file
+    return last;
+}
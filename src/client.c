@@ -0,0 +1,88 @@
+// client.c
+// Sends operations to a running server (see server.h) instead of loading the disk
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "server.h"
+#include "client.h"
+
+static int read_response(int server, FILE* output);
+
+// Returns a connection to the server, -1 if no server is running
+int client_connect(const char* socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        return -1;
+    }
+    if (connect(server, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(server);
+        return -1;
+    }
+    return server;
+}
+
+// Run one operation on the server and copy its output to (FILE* output)
+// Returns the status of the operation
+int client_request(int server, int op, const char* path, const void* data, unsigned long size, FILE* output) {
+    struct Request request = {
+        .op = op,
+        .path_size = path ? strlen(path) : 0,
+        .data_size = data ? size : 0
+    };
+    if (write_full(server, &request, sizeof(request)) != 0 ||
+        write_full(server, path, request.path_size) != 0 ||
+        write_full(server, data, request.data_size) != 0) {
+        fprintf(output, "Lost connection to the server\n");
+        return -1;
+    }
+    return read_response(server, output);
+}
+
+// Run an operation that reads its data from fd. The server gets the descriptor itself,
+// so the data doesn't have to go through the client
+int client_request_fd(int server, int op, const char* path, int fd, FILE* output) {
+    struct Request request = {
+        .op = op,
+        .path_size = path ? strlen(path) : 0
+    };
+    if (write_full(server, &request, sizeof(request)) != 0 ||
+        write_full(server, path, request.path_size) != 0 ||
+        send_fd(server, fd) != 0) {
+        fprintf(output, "Lost connection to the server\n");
+        return -1;
+    }
+    return read_response(server, output);
+}
+
+int read_response(int server, FILE* output) {
+    struct Response response;
+    if (read_full(server, &response, sizeof(response)) != 0) {
+        fprintf(output, "Lost connection to the server\n");
+        return -1;
+    }
+    char buffer[1 << 14];
+    while (response.size > 0) {
+        unsigned long count = response.size < sizeof(buffer) ? response.size : sizeof(buffer);
+        if (read_full(server, buffer, count) != 0) {
+            fprintf(output, "Lost connection to the server\n");
+            return -1;
+        }
+        fwrite(buffer, 1, count, output);
+        response.size -= count;
+    }
+    return response.status;
+}
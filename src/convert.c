@@ -0,0 +1,410 @@
+// convert.c
+// Rewrites disks of an older layout version (see FS_VERSION) in the current one. The old
+// image is only read: the directory tree is copied into a new disk of the same size and
+// block size, which then replaces the image. Version 1 disks and disks of the original layout
+// have no version field, so the image is checked against both before anything is converted
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "file_system.h"
+#include "block.h"
+#include "file.h"
+#include "dir.h"
+#include "alloc.h"
+#include "journal.h"
+#include "read.h"
+#include "fs2.h"
+#include "convert.h"
+
+// Version 1 data block, which was followed by its data
+struct V1_block {
+    char block_type;
+    int bytes_used;
+    unsigned long next;
+    char data[];
+};
+
+// Original disk header, data block and file header. Blocks held their data inline, directories
+// were arrays of header addresses, and nothing was aligned, so these are only read with memcpy
+#define ORIGINAL_BLOCK_SIZE 32
+
+struct Original_header {
+    int magic;
+    unsigned long disk_size;
+    unsigned long root_directory;
+    unsigned long current_directory;
+};
+
+struct Original_block {
+    char block_type;
+    char data[ORIGINAL_BLOCK_SIZE];
+    int bytes_used;
+    unsigned long next;
+};
+
+struct Original_file {
+    char block_type;
+    char name[FILE_NAME_SIZE];
+    unsigned long id;
+    int size;
+    int type;
+    int mode;
+    unsigned long first_block;
+};
+
+enum Old_layouts {
+    LAYOUT_ORIGINAL,
+    LAYOUT_V1
+};
+
+// A block or file header of the old disk, whichever layout it was read from
+struct Old_block {
+    const char* data;
+    unsigned long bytes_used;
+    unsigned long next;
+};
+
+struct Old_file {
+    char name[FILE_NAME_SIZE + 1];
+    int type;
+    unsigned long size;
+    unsigned long first_block;
+};
+
+struct Convert_state {
+    FILE* output;
+    int layout;
+    const char* image;
+    unsigned long image_size;
+    unsigned long block_size;
+    unsigned long entry_size;   // Size of a directory entry
+    unsigned long max_blocks;   // Longer chains than this loop
+    unsigned long current;      // Working directory of the old disk
+    unsigned long new_current;
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long bytes;
+};
+
+static const void* old_ptr(const struct Convert_state* state, unsigned long addr, unsigned long size);
+static const struct V1_block* v1_block(const struct Convert_state* state, unsigned long addr);
+static const char* check_v1_disk(const struct Convert_state* state, const struct FS_disk_header* old);
+static const char* check_original_disk(const struct Convert_state* state, const struct Original_header* old);
+static int old_block(const struct Convert_state* state, unsigned long addr, struct Old_block* block);
+static int old_file(const struct Convert_state* state, unsigned long addr, struct Old_file* file);
+static unsigned long old_entry(const struct Convert_state* state, const char* entry);
+static int convert_file(struct Convert_state* state, const struct Old_file* file);
+static int convert_dir(struct Convert_state* state, const struct Old_file* dir);
+
+// Returns a pointer into the old image, NULL if [addr, addr + size) isn't inside it
+const void* old_ptr(const struct Convert_state* state, unsigned long addr, unsigned long size) {
+    if (addr == 0 || addr > state->image_size || size > state->image_size - addr) {
+        return NULL;
+    }
+    return state->image + addr;
+}
+
+const struct V1_block* v1_block(const struct Convert_state* state, unsigned long addr) {
+    const struct V1_block* block = old_ptr(state, addr, sizeof(struct V1_block) + state->block_size);
+    if (!block || block->block_type != BLOCK_USED || block->bytes_used < 0 ||
+        (unsigned long)block->bytes_used > state->block_size) {
+        return NULL;
+    }
+    return block;
+}
+
+// Check the header and the root directory of the old disk against the version 1 layout
+// Returns what doesn't match, NULL if nothing
+const char* check_v1_disk(const struct Convert_state* state, const struct FS_disk_header* old) {
+    if (old->disk_size < sizeof(struct FS_disk_header)) {
+        return "Invalid disk size";
+    }
+    if (old->block_size < MIN_BLOCK_SIZE || old->block_size > MAX_BLOCK_SIZE || (old->block_size % sizeof(struct Dir_entry)) != 0) {
+        return "Invalid block size";
+    }
+    const struct FSFILE* root = old_ptr(state, old->root_directory, TOTAL_FILE_HEADER_SIZE);
+    if (!root || root->block_type != BLOCK_FILE_HEADER || root->type != T_DIR ||
+        root->size < 2 * sizeof(struct Dir_entry) || (root->size % sizeof(struct Dir_entry)) != 0) {
+        return "Root directory is missing";
+    }
+    // The first entry of a directory is the directory itself
+    const struct V1_block* block = v1_block(state, root->first_block);
+    const struct Dir_entry* self = block && block->bytes_used >= sizeof(struct Dir_entry) ? (const struct Dir_entry*)block->data : NULL;
+    if (!self || self->file != old->root_directory || self->type != T_DIR || self->id != root->id) {
+        return "Root directory doesn't refer to itself";
+    }
+    return NULL;
+}
+
+// Check the header and the root directory of the old disk against the original layout
+// Returns what doesn't match, NULL if nothing
+const char* check_original_disk(const struct Convert_state* state, const struct Original_header* old) {
+    if (old->disk_size < sizeof(struct Original_header)) {
+        return "Invalid disk size";
+    }
+    struct Old_file root;
+    if (old_file(state, old->root_directory, &root) != 0 || root.type != T_DIR ||
+        root.size < 2 * sizeof(addr_t) || (root.size % sizeof(addr_t)) != 0) {
+        return "Root directory is missing";
+    }
+    // The first entry of a directory is the directory itself
+    struct Old_block block;
+    if (old_block(state, root.first_block, &block) != 0 || block.bytes_used < sizeof(addr_t) ||
+        old_entry(state, block.data) != old->root_directory) {
+        return "Root directory doesn't refer to itself";
+    }
+    return NULL;
+}
+
+// Read the used data block at addr of the old disk into block
+// Returns 0 for no error (any other return value is an error)
+int old_block(const struct Convert_state* state, unsigned long addr, struct Old_block* block) {
+    if (state->layout == LAYOUT_V1) {
+        const struct V1_block* v1 = v1_block(state, addr);
+        if (!v1) {
+            return -1;
+        }
+        block->data = v1->data;
+        block->bytes_used = v1->bytes_used;
+        block->next = v1->next;
+        return 0;
+    }
+    const char* ptr = old_ptr(state, addr, sizeof(struct Original_block));
+    struct Original_block original;
+    if (!ptr) {
+        return -1;
+    }
+    memcpy(&original, ptr, sizeof(original));
+    if (original.block_type != BLOCK_USED || original.bytes_used < 0 || original.bytes_used > ORIGINAL_BLOCK_SIZE) {
+        return -1;
+    }
+    block->data = ptr + offsetof(struct Original_block, data);
+    block->bytes_used = original.bytes_used;
+    block->next = original.next;
+    return 0;
+}
+
+// Read the file header at addr of the old disk into file
+// Returns 0 for no error (any other return value is an error)
+int old_file(const struct Convert_state* state, unsigned long addr, struct Old_file* file) {
+    memset(file, 0, sizeof(struct Old_file));
+    if (state->layout == LAYOUT_V1) {
+        const struct FSFILE* v1 = old_ptr(state, addr, TOTAL_FILE_HEADER_SIZE);
+        if (!v1 || v1->block_type != BLOCK_FILE_HEADER) {
+            return -1;
+        }
+        memcpy(file->name, v1->name, FILE_NAME_SIZE);
+        file->type = v1->type;
+        file->size = v1->size;
+        file->first_block = v1->first_block;
+        return 0;
+    }
+    const char* ptr = old_ptr(state, addr, sizeof(struct Original_file));
+    struct Original_file original;
+    if (!ptr) {
+        return -1;
+    }
+    memcpy(&original, ptr, sizeof(original));
+    if (original.block_type != BLOCK_FILE_HEADER || original.size < 0) {
+        return -1;
+    }
+    memcpy(file->name, original.name, FILE_NAME_SIZE);
+    file->type = original.type;
+    file->size = original.size;
+    file->first_block = original.first_block;
+    return 0;
+}
+
+// Returns the address of the file header a directory entry of the old disk points to
+unsigned long old_entry(const struct Convert_state* state, const char* entry) {
+    if (state->layout == LAYOUT_V1) {
+        struct Dir_entry v1;
+        memcpy(&v1, entry, sizeof(v1));
+        return v1.file;
+    }
+    addr_t addr;
+    memcpy(&addr, entry, sizeof(addr));
+    return addr;
+}
+
+// The copy gets a new id from its name, the same way files created on the new disk do
+int convert_file(struct Convert_state* state, const struct Old_file* file) {
+    FSFILE* copy = fs_open(file->name, "w");
+    if (!copy || fs_reserve(copy, file->size) != 0) {
+        fs_close(copy);
+        return -1;
+    }
+    unsigned long remaining = file->size;
+    unsigned long steps = 0;
+    struct Old_block block;
+    int found = old_block(state, file->first_block, &block) == 0;
+    for (; found && remaining > 0 && steps++ < state->max_blocks; found = old_block(state, block.next, &block) == 0) {
+        unsigned long size = block.bytes_used < remaining ? block.bytes_used : remaining;
+        if (fs_write(block.data, size, copy) != 0) {
+            fs_close(copy);
+            return -1;
+        }
+        remaining -= size;
+    }
+    fs_close(copy);
+    if (remaining > 0) {
+        fprintf(state->output, COLOR_MESSAGE "'%s'" NONE ": Blocks are missing, " COLOR_NUMBERS "%lu" NONE " bytes were lost\n", file->name, remaining);
+    }
+    state->files++;
+    state->bytes += file->size - remaining;
+    return 0;
+}
+
+// Copy the entries of the old directory into the current directory
+int convert_dir(struct Convert_state* state, const struct Old_file* dir) {
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long current = header->current_directory;
+    unsigned long index = 0;
+    unsigned long steps = 0;
+
+    struct Old_block block;
+    int found = old_block(state, dir->first_block, &block) == 0;
+    for (; found && steps++ < state->max_blocks; found = old_block(state, block.next, &block) == 0) {
+        for (unsigned long i = 0; i + state->entry_size <= block.bytes_used; i += state->entry_size) {
+            unsigned long addr = old_entry(state, block.data + i);
+            struct Old_file file;
+            // Skip the current and parent directory
+            if (index++ < 2 || addr == 0 || old_file(state, addr, &file) != 0)
+                continue;
+
+            if (file.type != T_DIR) {
+                if (convert_file(state, &file) != 0)
+                    return -1;
+                continue;
+            }
+            FSFILE* sub_dir = fs_create_dir(file.name);
+            if (!sub_dir) {
+                return -1;
+            }
+            state->dirs++;
+            header->current_directory = get_absolute_address(sub_dir);
+            if (addr == state->current)
+                state->new_current = header->current_directory;
+            int result = convert_dir(state, &file);
+            header->current_directory = current;
+            fs_close(sub_dir);
+            if (result != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Convert the image at path to the current layout. Nothing is written unless the whole
+// tree fits in the new disk. The disk isn't loaded afterwards
+int convert_disk(const char* path, FILE* output) {
+    // Committed batches of the old journal belong to the image being converted
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to open disk\n", path);
+        return -1;
+    }
+    int replayed = journal_replay(fd);
+    close(fd);
+    if (replayed != 0) {
+        return -1;
+    }
+
+    struct Convert_state state = { .output = output };
+    struct stat st;
+    char* image = stat(path, &st) == 0 && (unsigned long)st.st_size >= sizeof(struct FS_disk_header) ? read_file(path) : NULL;
+    const struct FS_disk_header* old = (const struct FS_disk_header*)image;
+    if (!image || old->magic != HEADER_MAGIC) {
+        free(image);
+        error(COLOR_MESSAGE "'%s'" NONE ": Not a valid disk\n", path);
+        return -1;
+    }
+    if (old->version != 0) {
+        int version = old->version;
+        free(image);
+        if (version == FS_VERSION) {
+            fprintf(output, "Disk already uses layout version " COLOR_NUMBERS "%i" NONE "\n", FS_VERSION);
+            return 0;
+        }
+        error(COLOR_MESSAGE "'%s'" NONE ": Unknown layout version " COLOR_NUMBERS "%i" NONE "\n", path, version);
+        return -1;
+    }
+    state.image = image;
+    state.image_size = old->disk_size < (unsigned long)st.st_size ? old->disk_size : (unsigned long)st.st_size;
+    state.layout = LAYOUT_V1;
+    state.block_size = old->block_size;
+    state.entry_size = sizeof(struct Dir_entry);
+    state.max_blocks = old->disk_size / (sizeof(struct V1_block) + old->block_size);
+    state.current = old->current_directory;
+    unsigned long root_addr = old->root_directory;
+
+    const char* problem = check_v1_disk(&state, old);
+    if (problem) {
+        const struct Original_header* original = (const struct Original_header*)image;
+        state.layout = LAYOUT_ORIGINAL;
+        state.block_size = ORIGINAL_BLOCK_SIZE;
+        state.entry_size = sizeof(addr_t);
+        state.max_blocks = original->disk_size / sizeof(struct Original_block);
+        state.current = original->current_directory;
+        root_addr = original->root_directory;
+
+        const char* original_problem = check_original_disk(&state, original);
+        if (original_problem) {
+            free(image);
+            error(COLOR_MESSAGE "'%s'" NONE ": Not a version 1 disk (%s) or a disk of the original layout (%s), it was left as it is\n",
+                path, problem, original_problem);
+            return -1;
+        }
+    }
+    struct Old_file root;
+    old_file(&state, root_addr, &root);
+
+    if (is_initialized()) {
+        fs_free();
+    }
+    if (fs_init(old->disk_size, state.block_size) != 0) {
+        if (is_initialized())
+            fs_free();
+        free(image);
+        return -1;
+    }
+    get_state()->log = fopen(DATA_PATH "/log/disk_events.log", "ab");
+
+    struct FS_disk_header* header = get_state()->disk_header;
+    state.new_current = header->root_directory;
+    int result = convert_dir(&state, &root);
+    free(image);
+    if (result != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": The files don't fit in a version " COLOR_NUMBERS "%i" NONE " disk of the same size\n", path, FS_VERSION);
+        fs_free();
+        return -1;
+    }
+    header->current_directory = state.new_current;
+    unsigned long disk_size = header->disk_size;
+
+    // Write the new image next to the old one first, so a failure leaves the old one intact
+    char new_path[PATH_MAX];
+    snprintf(new_path, sizeof(new_path), "%s.convert", path);
+    fs_dump_disk(new_path);
+    fs_free();
+    if (stat(new_path, &st) != 0 || (unsigned long)st.st_size != disk_size) {
+        unlink(new_path);
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write the converted disk\n", path);
+        return -1;
+    }
+    if (rename(new_path, path) != 0) {
+        unlink(new_path);
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to replace disk\n", path);
+        return -1;
+    }
+
+    fprintf(output, "Converted " COLOR_NUMBERS "%lu" NONE " files (" COLOR_NUMBERS "%lu" NONE " bytes) and "
+        COLOR_NUMBERS "%lu" NONE " directories to layout version " COLOR_NUMBERS "%i" NONE "\n",
+        state.files, state.bytes, state.dirs, FS_VERSION);
+    return 0;
+}
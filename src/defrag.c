@@ -0,0 +1,226 @@
+// defrag.c
+// Rewrites fragmented files so that their blocks form one contiguous run of the block table,
+// and moves the headers of the files of each directory next to each other, in directory order.
+// Headers and directory entries move, so no files may be open while it runs
+
+#include "file_system.h"
+#include "block.h"
+#include "file.h"
+#include "alloc.h"
+#include "index.h"
+#include "dir.h"
+#include "dir_index.h"
+#include "dentry.h"
+#include "defrag.h"
+
+static unsigned long count_extents(const struct FSFILE* file, unsigned long* blocks);
+static void add_file_stats(const struct FSFILE* file, struct Frag_stats* stats);
+static void collect_stats(const struct FSFILE* dir, struct Frag_stats* stats);
+static void relocate_blocks(struct FSFILE* file, FILE* output);
+static int pack_headers(struct FSFILE* dir);
+static int defrag_dir(struct FSFILE* dir, unsigned long parent, FILE* output);
+
+// Count the runs of blocks of the file that are next to each other in the block table, and
+// assign the number of blocks to (blocks). Holes don't end a run
+unsigned long count_extents(const struct FSFILE* file, unsigned long* blocks) {
+    unsigned long extents = 0;
+    unsigned long previous = 0;
+    struct Map_cursor map;
+    *blocks = 0;
+    for (unsigned long addr = map_cursor_start(&map, file, 0); map.index < file->block_count; addr = map_cursor_next(&map)) {
+        if (addr == 0)
+            continue;
+        if (addr != previous + sizeof(struct Data_block))
+            extents++;
+        previous = addr;
+        (*blocks)++;
+    }
+    return extents;
+}
+
+void add_file_stats(const struct FSFILE* file, struct Frag_stats* stats) {
+    unsigned long blocks = 0;
+    unsigned long extents = count_extents(file, &blocks);
+    stats->files++;
+    stats->blocks += blocks;
+    stats->extents += extents;
+    if (extents > 1) {
+        stats->fragmented++;
+        stats->breaks += extents - 1;
+    }
+    if (blocks > 1)
+        stats->links += blocks - 1;
+}
+
+void collect_stats(const struct FSFILE* dir, struct Frag_stats* stats) {
+    unsigned long count = dir->size / sizeof(struct Dir_entry);
+    for (unsigned long i = 2; i < count; i++) {
+        struct Dir_entry* entry = get_dir_entry(dir, i);
+        const struct FSFILE* file = entry ? get_ptr(entry->file) : NULL;
+        if (!file)
+            continue;
+        add_file_stats(file, stats);
+        if (file->type == T_DIR)
+            collect_stats(file, stats);
+    }
+}
+
+void get_frag_stats(struct Frag_stats* stats) {
+    memset(stats, 0, sizeof(struct Frag_stats));
+    const struct FSFILE* root = get_ptr(get_state()->disk_header->root_directory);
+    if (!root) {
+        return;
+    }
+    add_file_stats(root, stats);
+    collect_stats(root, stats);
+}
+
+void print_frag_stats(const struct Frag_stats* stats, const char* label, FILE* output) {
+    double fragmentation = stats->links > 0 ? 100.0 * stats->breaks / stats->links : 0;
+    fprintf(output, "%s: " COLOR_NUMBERS "%lu" NONE " files, " COLOR_NUMBERS "%lu" NONE " blocks in "
+        COLOR_NUMBERS "%lu" NONE " extents, " COLOR_NUMBERS "%lu" NONE " fragmented files (%.1f%% fragmentation)\n",
+        label, stats->files, stats->blocks, stats->extents, stats->fragmented, fragmentation);
+}
+
+// Copy the blocks of a fragmented file into one new run of the block table and free the
+// old ones. Headers live outside the block zone, so the file itself stays where it is, and
+// holes stay holes. Files that can't be given a run are listed in output
+void relocate_blocks(struct FSFILE* file, FILE* output) {
+    unsigned long count = 0;
+    if (count_extents(file, &count) <= 1) {
+        return;
+    }
+    struct Data_block* blocks = try_allocate_blocks(count);
+    if (!blocks) {
+        fprintf(output, COLOR_MESSAGE "'%s'" NONE ": No room for " COLOR_NUMBERS "%lu" NONE " contiguous blocks, left fragmented\n", file->name, count);
+        return;
+    }
+
+    unsigned long n = 0;
+    struct Map_cursor map;
+    for (unsigned long old_addr = map_cursor_start(&map, file, 0); map.index < file->block_count; old_addr = map_cursor_next(&map)) {
+        if (old_addr == 0)
+            continue;
+        struct Data_block* old = get_ptr(old_addr);
+        char* data = get_block_data(&blocks[n]);
+        blocks[n].bytes_used = old->bytes_used;
+        memcpy(data, get_block_data(old), old->bytes_used);
+        mark_dirty(data, old->bytes_used);
+        map_file_block(file, map.index, get_absolute_address(&blocks[n]));
+        free_block(old_addr, sizeof(struct Data_block), BLOCK_USED);
+        n++;
+    }
+    file->first_block = get_absolute_address(blocks);
+    file->last_block = get_absolute_address(&blocks[count - 1]);
+    mark_dirty(blocks, count * sizeof(struct Data_block));
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+
+    // The index points into the old blocks
+    if (file->type == T_DIR && file->dir_index) {
+        dir_index_free(file);
+        dir_index_build(file);
+    }
+    release_free_lists();
+}
+
+// Move the headers of the files of the directory into one run, in directory order, so that
+// listing it reads them one after another. Directory entries, the self entries of moved
+// directories and the current directory follow the headers
+int pack_headers(struct FSFILE* dir) {
+    unsigned long count = dir->size / sizeof(struct Dir_entry);
+    unsigned long files = 0;
+    unsigned long previous = 0;
+    int packed = 1;
+    for (unsigned long i = 2; i < count; i++) {
+        struct Dir_entry* entry = get_dir_entry(dir, i);
+        if (!entry || entry->file == 0)
+            continue;
+        if (files > 0 && entry->file != previous + TOTAL_FILE_HEADER_SIZE)
+            packed = 0;
+        previous = entry->file;
+        files++;
+    }
+    if (files <= 1 || packed) {
+        return 0;
+    }
+    char* run = allocate(files * TOTAL_FILE_HEADER_SIZE);
+    if (!run) {
+        return -1;
+    }
+
+    struct FS_disk_header* header = get_state()->disk_header;
+    struct FSFILE* moved = (struct FSFILE*)run;
+    for (unsigned long i = 2; i < count; i++) {
+        struct Dir_entry* entry = get_dir_entry(dir, i);
+        if (!entry || entry->file == 0)
+            continue;
+        unsigned long old_addr = entry->file;
+        memcpy(moved, get_ptr(old_addr), TOTAL_FILE_HEADER_SIZE);
+        entry->file = get_absolute_address(moved);
+        mark_dirty(entry, sizeof(struct Dir_entry));
+        if (moved->type == T_DIR) {
+            struct Dir_entry* self = get_dir_entry(moved, 0);
+            self->file = entry->file;
+            mark_dirty(self, sizeof(struct Dir_entry));
+        }
+        if (header->current_directory == old_addr) {
+            header->current_directory = entry->file;
+            mark_dirty(header, sizeof(struct FS_disk_header));
+        }
+        free_block(old_addr, TOTAL_FILE_HEADER_SIZE, BLOCK_FILE_HEADER);
+        moved++;
+    }
+    mark_dirty(run, files * TOTAL_FILE_HEADER_SIZE);
+    release_free_lists();
+    return 0;
+}
+
+// Files are relocated in directory order, so the files of a directory end up close to each other
+int defrag_dir(struct FSFILE* dir, unsigned long parent, FILE* output) {
+    if (dir->dead_entries > 0 && compact_dir(dir) != 0) {
+        return -1;
+    }
+    if (pack_headers(dir) != 0) {
+        return -1;
+    }
+    // The header of the parent may have moved
+    struct Dir_entry* parent_entry = get_dir_entry(dir, 1);
+    parent_entry->file = parent;
+    mark_dirty(parent_entry, sizeof(struct Dir_entry));
+
+    unsigned long count = dir->size / sizeof(struct Dir_entry);
+    for (unsigned long i = 2; i < count; i++) {
+        struct Dir_entry* entry = get_dir_entry(dir, i);
+        struct FSFILE* file = entry ? get_ptr(entry->file) : NULL;
+        if (!file)
+            continue;
+        relocate_blocks(file, output);
+        if (file->type == T_DIR && defrag_dir(file, get_absolute_address(dir), output) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int defrag_disk(FILE* output) {
+    struct FS_disk_header* header = get_state()->disk_header;
+    struct FSFILE* root = get_ptr(header->root_directory);
+    if (!root) {
+        error("Root directory isn't set\n");
+        return -1;
+    }
+
+    struct Frag_stats stats;
+    get_frag_stats(&stats);
+    print_frag_stats(&stats, "Before", output);
+
+    release_free_lists();
+    relocate_blocks(root, output);
+    int result = defrag_dir(root, get_absolute_address(root), output);
+    // Resolved path components point at the old headers
+    dentry_free();
+
+    get_frag_stats(&stats);
+    print_frag_stats(&stats, "After", output);
+    return result;
+}
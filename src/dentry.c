@@ -0,0 +1,154 @@
+// dentry.c
+// In-memory cache of resolved path components, evicted least recently used first
+
+#include "file_system.h"
+#include "file.h"
+#include "dentry.h"
+
+static struct Dentry_cache* get_cache(int create);
+static int* find_link(struct Dentry_cache* cache, unsigned long dir, unsigned long id, const char* name);
+static void lru_unlink(struct Dentry_cache* cache, int n);
+static void lru_push(struct Dentry_cache* cache, int n);
+static void remove_entry(struct Dentry_cache* cache, int* link);
+
+struct Dentry_cache* get_cache(int create) {
+    struct FS_state* state = get_state();
+    if (!state->dentries && create) {
+        state->dentries = calloc(1, sizeof(struct Dentry_cache));
+    }
+    return state->dentries;
+}
+
+// Get the link that points to the entry, so that it can also be unlinked. NULL if there is no entry
+int* find_link(struct Dentry_cache* cache, unsigned long dir, unsigned long id, const char* name) {
+    int* link = &cache->buckets[(id ^ (dir * 0x9e3779b97f4a7c15UL)) % DENTRY_BUCKETS];
+    while (*link) {
+        struct Dentry* entry = &cache->entries[*link - 1];
+        if (entry->dir == dir && entry->id == id && strncmp(entry->name, name, FILE_NAME_SIZE) == 0) {
+            return link;
+        }
+        link = &entry->hash_next;
+    }
+    return NULL;
+}
+
+void lru_unlink(struct Dentry_cache* cache, int n) {
+    struct Dentry* entry = &cache->entries[n - 1];
+    if (entry->lru_prev)
+        cache->entries[entry->lru_prev - 1].lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        cache->entries[entry->lru_next - 1].lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+}
+
+void lru_push(struct Dentry_cache* cache, int n) {
+    struct Dentry* entry = &cache->entries[n - 1];
+    entry->lru_prev = 0;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->entries[cache->lru_head - 1].lru_prev = n;
+    else
+        cache->lru_tail = n;
+    cache->lru_head = n;
+}
+
+// The freed entry is swapped with the last one, so that used entries stay at the front
+void remove_entry(struct Dentry_cache* cache, int* link) {
+    int n = *link;
+    *link = cache->entries[n - 1].hash_next;
+    lru_unlink(cache, n);
+
+    int last = cache->count--;
+    if (n == last)
+        return;
+
+    struct Dentry* moved = &cache->entries[last - 1];
+    int* moved_link = find_link(cache, moved->dir, moved->id, moved->name);
+    *moved_link = n;
+    if (moved->lru_prev)
+        cache->entries[moved->lru_prev - 1].lru_next = n;
+    else
+        cache->lru_head = n;
+    if (moved->lru_next)
+        cache->entries[moved->lru_next - 1].lru_prev = n;
+    else
+        cache->lru_tail = n;
+    cache->entries[n - 1] = *moved;
+}
+
+// Returns 1 and assigns the file header address (0 if the file doesn't exist) when the component is cached
+int dentry_lookup(unsigned long dir, unsigned long id, const char* name, unsigned long* file) {
+    struct Dentry_cache* cache = get_cache(0);
+    if (!cache) {
+        return 0;
+    }
+    int* link = find_link(cache, dir, id, name);
+    if (!link) {
+        return 0;
+    }
+    lru_unlink(cache, *link);
+    lru_push(cache, *link);
+    *file = cache->entries[*link - 1].file;
+    return 1;
+}
+
+void dentry_insert(unsigned long dir, unsigned long id, const char* name, unsigned long file) {
+    struct Dentry_cache* cache = get_cache(1);
+    if (!cache) {
+        return;
+    }
+    int* link = find_link(cache, dir, id, name);
+    if (link) {
+        cache->entries[*link - 1].file = file;
+        return;
+    }
+    if (cache->count == DENTRY_CACHE_SIZE) {
+        struct Dentry* oldest = &cache->entries[cache->lru_tail - 1];
+        remove_entry(cache, find_link(cache, oldest->dir, oldest->id, oldest->name));
+    }
+
+    int n = ++cache->count;
+    struct Dentry* entry = &cache->entries[n - 1];
+    entry->dir = dir;
+    entry->id = id;
+    entry->file = file;
+    strncpy(entry->name, name, FILE_NAME_SIZE);
+
+    int* bucket = &cache->buckets[(id ^ (dir * 0x9e3779b97f4a7c15UL)) % DENTRY_BUCKETS];
+    entry->hash_next = *bucket;
+    *bucket = n;
+    lru_push(cache, n);
+}
+
+void dentry_invalidate(unsigned long dir, unsigned long id, const char* name) {
+    struct Dentry_cache* cache = get_cache(0);
+    if (!cache) {
+        return;
+    }
+    int* link = find_link(cache, dir, id, name);
+    if (link) {
+        remove_entry(cache, link);
+    }
+}
+
+// Forget everything cached inside a removed directory, since its address may be reused
+void dentry_invalidate_dir(unsigned long dir) {
+    struct Dentry_cache* cache = get_cache(0);
+    if (!cache) {
+        return;
+    }
+    for (int i = cache->count; i > 0; i--) {
+        if (i <= cache->count && cache->entries[i - 1].dir == dir) {
+            struct Dentry* entry = &cache->entries[i - 1];
+            remove_entry(cache, find_link(cache, entry->dir, entry->id, entry->name));
+        }
+    }
+}
+
+void dentry_free() {
+    free(get_state()->dentries);
+    get_state()->dentries = NULL;
+}
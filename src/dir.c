@@ -4,28 +4,49 @@
 #include "block.h"
 #include "file.h"
 #include "dir.h"
+#include "dir_index.h"
+#include "index.h"
+#include "dentry.h"
 
 typedef struct FSFILE FSFILE;
 
 static struct FSFILE* get_parent_dir(const FSFILE* dir);
 static struct FSFILE* get_current_dir();
+static struct FSFILE* find_component(FSFILE* dir, unsigned long id, const char* name);
 static int pwd(const FSFILE* current, FILE* output);
 
-struct FSFILE* get_parent_dir(const FSFILE* dir) {
-	assert(dir != NULL);
-	struct Data_block* block = read_block(dir->first_block);
-	if (!block) {
-		error(COLOR_MESSAGE "'%s'" NONE ": Directory is empty\n", dir->name);
+// Get the n-th entry of the directory, NULL if there are fewer entries
+struct Dir_entry* get_dir_entry(const FSFILE* dir, unsigned long n) {
+	unsigned long per_block = get_block_size() / sizeof(struct Dir_entry);
+	struct Data_block* block = read_block(get_file_block(dir, n / per_block));
+	if (!block || (n % per_block) >= block->bytes_used / sizeof(struct Dir_entry)) {
 		return NULL;
 	}
-	if (block->bytes_used >= (2 * sizeof(addr_t))) {
-		addr_t* addr = (addr_t*)block->data;
-		return get_ptr(addr[1]);
+	return &((struct Dir_entry*)get_block_data(block))[n % per_block];
+}
+
+struct FSFILE* get_parent_dir(const FSFILE* dir) {
+	assert(dir != NULL);
+	struct Dir_entry* parent = get_dir_entry(dir, 1);
+	if (parent) {
+		return get_ptr(parent->file);
 	}
 	error(COLOR_MESSAGE "'%s'" NONE ": Directory is empty\n", dir->name);
 	return NULL;
 }
 
+// Look up a path component through the dentry cache, also remembering components that don't exist
+struct FSFILE* find_component(FSFILE* dir, unsigned long id, const char* name) {
+	addr_t dir_addr = get_absolute_address(dir);
+	addr_t file_addr = 0;
+	if (dentry_lookup(dir_addr, id, name, &file_addr)) {
+		return get_ptr(file_addr);
+	}
+	FSFILE* file = strcmp(name, "..") == 0 ? get_parent_dir(dir) : find_file(dir, id, name, NULL, NULL);
+	dentry_insert(dir_addr, id, name, file ? get_absolute_address(file) : 0);
+	return file;
+}
+
 struct FSFILE* get_current_dir() {
 	return get_ptr(get_state()->disk_header->current_directory);
 }
@@ -43,9 +64,9 @@ int pwd(const FSFILE* current, FILE* output) {
 }
 
 // Find the location of the file in this directory
-// Result is assigned to (addr_t* location)
+// Result is assigned to (struct Dir_entry** location)
 // Returns 0 for no error (any other return value is an error)
-int find_in_dir(const struct FSFILE* dir, const struct FSFILE* file, addr_t** location) {
+int find_in_dir(const struct FSFILE* dir, const struct FSFILE* file, struct Dir_entry** location) {
     assert(dir != NULL);
     assert(file != NULL);
     assert(dir != file);
@@ -54,34 +75,42 @@ int find_in_dir(const struct FSFILE* dir, const struct FSFILE* file, addr_t** lo
 
     addr_t file_addr = get_absolute_address(file);
 
-    struct Data_block* block = read_block(dir->first_block);
+    if (dir->dir_index) {
+        struct Dir_entry* slot = get_ptr(dir_index_find(dir, file->id, file->name));
+        if (slot && slot->file == file_addr) {
+            *location = slot;
+            return 0;
+        }
+        error(COLOR_MESSAGE "'%s/%s'" NONE ": File address wasn't found in this directory\n", dir->name, file->name);
+        return -1;
+    }
+
+    struct Block_cursor cursor;
+    struct Data_block* block = cursor_start(&cursor, dir->first_block);
     if (!block) {
         error(COLOR_MESSAGE "'%s/'" NONE ": Folder is empty\n", dir->name);
         return -1;
     }
     int skip = 2;   // Number to skip parent and current directory in directory we are reading in
     do {
-        addr_t* addr = (addr_t*)block->data;
-        for (int i = 0; i < block->bytes_used / (sizeof(addr_t)); i++) {
+        struct Dir_entry* entries = (struct Dir_entry*)get_block_data(block);
+        for (int i = 0; i < block->bytes_used / sizeof(struct Dir_entry); i++) {
             if (skip > 0) {
                 --skip;
                 continue;
             }
-            if (addr[i] == file_addr) {
-                *location = &addr[i];
+            if (entries[i].id == file->id && entries[i].file == file_addr) {
+                *location = &entries[i];
                 return 0;
             }
         }
-    } while ((block = read_block(block->next)) != NULL);
+    } while ((block = cursor_next(&cursor)) != NULL);
     error(COLOR_MESSAGE "'%s/%s'" NONE ": File address wasn't found in this directory\n", dir->name, file->name);
     return -1;  // The file wasn't found
 }
 
-int read_dir_contents(const struct FSFILE* file, unsigned long block_addr, int iteration, FILE* output) {
-    if (!can_access_address(block_addr)) {
-        return -1;
-    }
-    if (!output || !is_initialized()) {
+int read_dir_contents(const struct FSFILE* file, FILE* output) {
+    if (!output || !is_initialized() || !can_access_address(file->first_block)) {
         return -1;
     }
 
@@ -90,41 +119,40 @@ int read_dir_contents(const struct FSFILE* file, unsigned long block_addr, int i
         return -1;
     }
 
-    struct Data_block* block = get_ptr(block_addr);
-    unsigned long* addr = (unsigned long*)block->data;
-
-    for (int i = 0; i < block->bytes_used / (sizeof(unsigned long)); i++, iteration++) {
-        if (addr[i] == 0)
-            continue;
-        
-        struct FSFILE* to_print = get_ptr(addr[i]);
-        if (to_print) {
-            fprintf(output, "%-7lu %i %7i ", addr[i], to_print->type, to_print->size);
+    struct Block_cursor cursor;
+    int iteration = 0;
+    for (struct Data_block* block = cursor_start(&cursor, file->first_block); block; block = cursor_next(&cursor)) {
+        struct Dir_entry* entries = (struct Dir_entry*)get_block_data(block);
 
-            if (iteration == 0) {
-                printf(COLOR_PATH ".\n" NONE);
+        for (int i = 0; i < block->bytes_used / sizeof(struct Dir_entry); i++, iteration++) {
+            if (entries[i].file == 0)
                 continue;
-            }
-            else if (iteration == 1) {
-                printf(COLOR_PATH "..\n" NONE);
-                continue;
-            }
 
-            if (to_print->type == T_DIR)
-                fprintf(output, COLOR_PATH "%s/" NONE, to_print->name);
-            else if (to_print->type == T_FILE)
-                fprintf(output, COLOR_FILE "%s" NONE, to_print->name);
-            else
-                fprintf(output, "%s", to_print->name);
-            
-            fprintf(output, "\n");
+            struct FSFILE* to_print = get_ptr(entries[i].file);
+            if (to_print) {
+                fprintf(output, "%-7lu %i %7lu ", (unsigned long)entries[i].file, (int)entries[i].type, to_print->size);
+
+                if (iteration == 0) {
+                    fprintf(output, COLOR_PATH ".\n" NONE);
+                    continue;
+                }
+                else if (iteration == 1) {
+                    fprintf(output, COLOR_PATH "..\n" NONE);
+                    continue;
+                }
+
+                if (to_print->type == T_DIR)
+                    fprintf(output, COLOR_PATH "%s/" NONE, to_print->name);
+                else if (to_print->type == T_FILE)
+                    fprintf(output, COLOR_FILE "%s" NONE, to_print->name);
+                else
+                    fprintf(output, "%s", to_print->name);
+
+                fprintf(output, "\n");
+            }
         }
     }
-
-    if (block->next == 0)
-        return 0;
-    
-    return read_dir_contents(file, block->next, iteration, output);
+    return 0;
 }
 
 // Get relative or absolute path directory (and file if supplied)
@@ -152,7 +180,7 @@ struct FSFILE* get_path_dir(const char* path, struct FSFILE** file) {
             // '..' The user wants to access the parent directory
     		// Read the second file of the directory
     		if (path[i + 1] == '.') {
-    			dir = get_parent_dir(dir);
+    			dir = find_component(dir, hash("..", 2), "..");
     			i += 2;
     			continue;
     		}
@@ -164,7 +192,7 @@ struct FSFILE* get_path_dir(const char* path, struct FSFILE** file) {
                 return dir;
             }
             unsigned long id = hash(file_name, index);
-            FSFILE* tmp = find_file(dir, id, NULL, NULL);
+            FSFILE* tmp = find_component(dir, id, file_name);
             if (!tmp) {
                 error(COLOR_MESSAGE "'%s'" NONE ": Invalid path", path);
                 return NULL;
@@ -209,9 +237,67 @@ int can_remove_dir(const struct FSFILE* file) {
 		return 0;
 	}
 
-	struct Data_block* block = read_block(file->first_block);
-	assert(block != NULL);	// Directories can't be empty
-	return block->bytes_used == (sizeof(addr_t) * 2);
+	assert(file->first_block != 0);	// Directories can't be empty
+	return file->size / sizeof(struct Dir_entry) - file->dead_entries == 2;
+}
+
+// Move the live entries of the directory to the left and free the blocks left empty
+int compact_dir(struct FSFILE* dir) {
+	assert(dir != NULL && dir->type == T_DIR);
+
+	unsigned long count = dir->size / sizeof(struct Dir_entry);
+	unsigned long live = 2;	// The directory itself and its parent are never cleared
+	for (unsigned long i = 2; i < count; i++) {
+		struct Dir_entry* entry = get_dir_entry(dir, i);
+		if (!entry || entry->file == 0)
+			continue;
+		if (i != live) {
+			struct Dir_entry* to = get_dir_entry(dir, live);
+			*to = *entry;
+			mark_dirty(to, sizeof(struct Dir_entry));
+		}
+		live++;
+	}
+	if (truncate_data(dir, live * sizeof(struct Dir_entry)) != 0) {
+		return -1;
+	}
+	dir->dead_entries = 0;
+	mark_dirty(dir, TOTAL_FILE_HEADER_SIZE);
+
+	// Entries have moved, so the index has to be rebuilt. With fewer entries a directory
+	// that couldn't be indexed may fit in an index again
+	if (dir->dir_index || dir->unindexed) {
+		dir_index_free(dir);
+		dir->unindexed = 0;
+		if (live >= DIR_INDEX_THRESHOLD)
+			dir_index_build(dir);
+	}
+	fslog("Compacted directory '%s' (%lu of %lu entries left)\n", dir->name, live, count);
+	return 0;
+}
+
+// Clear an entry of the directory. Cleared entries at the end are dropped right away,
+// the rest once there are enough of them to be worth compacting
+void release_dir_entry(struct FSFILE* dir, struct Dir_entry* entry) {
+	memset(entry, 0, sizeof(struct Dir_entry));
+	mark_dirty(entry, sizeof(struct Dir_entry));
+	dir->dead_entries++;
+
+	unsigned long count = dir->size / sizeof(struct Dir_entry);
+	unsigned long end = count;
+	struct Dir_entry* last = NULL;
+	while (end > 2 && (last = get_dir_entry(dir, end - 1)) && last->file == 0)
+		end--;
+	if (end < count) {
+		truncate_data(dir, end * sizeof(struct Dir_entry));
+		dir->dead_entries -= count - end;
+		count = end;
+	}
+
+	if (dir->dead_entries >= DIR_COMPACT_MIN_DEAD && dir->dead_entries * DIR_COMPACT_RATIO >= count) {
+		compact_dir(dir);
+	}
+	mark_dirty(dir, TOTAL_FILE_HEADER_SIZE);
 }
 
 // UNUSED
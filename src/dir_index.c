@@ -0,0 +1,205 @@
+// dir_index.c
+// On-disk hash index of large directories, so that lookups don't scan every entry
+
+#include "file_system.h"
+#include "block.h"
+#include "file.h"
+#include "alloc.h"
+#include "dir.h"
+#include "dir_index.h"
+
+static unsigned long index_size(int depth);
+static struct Dir_bucket* get_bucket(const struct Dir_index* index, unsigned long id);
+static struct Dir_bucket* allocate_bucket(int depth);
+static int grow_index(struct FSFILE* dir);
+static int split_bucket(struct FSFILE* dir, unsigned long id);
+
+unsigned long index_size(int depth) {
+    return sizeof(struct Dir_index) + (1UL << depth) * sizeof(unsigned long);
+}
+
+struct Dir_bucket* get_bucket(const struct Dir_index* index, unsigned long id) {
+    return get_ptr(index->buckets[id & ((1UL << index->depth) - 1)]);
+}
+
+struct Dir_bucket* allocate_bucket(int depth) {
+    struct Dir_bucket* bucket = allocate(sizeof(struct Dir_bucket));
+    if (bucket) {
+        bucket->block_type = BLOCK_DIR_BUCKET;
+        bucket->depth = depth;
+        bucket->count = 0;
+    }
+    return bucket;
+}
+
+// Double the number of bucket addresses, each new one pointing to the same bucket as its twin
+int grow_index(struct FSFILE* dir) {
+    struct Dir_index* index = get_ptr(dir->dir_index);
+    if (index->depth >= DIR_INDEX_MAX_DEPTH) {
+        return -1;
+    }
+    struct Dir_index* grown = allocate(index_size(index->depth + 1));
+    if (!grown) {
+        return -1;
+    }
+    unsigned long count = 1UL << index->depth;
+    grown->block_type = BLOCK_DIR_INDEX;
+    grown->depth = index->depth + 1;
+    memcpy(grown->buckets, index->buckets, count * sizeof(unsigned long));
+    memcpy(grown->buckets + count, index->buckets, count * sizeof(unsigned long));
+
+    free_block(dir->dir_index, index_size(index->depth), BLOCK_DIR_INDEX);
+    dir->dir_index = get_absolute_address(grown);
+    mark_dirty(dir, TOTAL_FILE_HEADER_SIZE);
+    return 0;
+}
+
+// Split the full bucket that id belongs to on the next bit of the id
+int split_bucket(struct FSFILE* dir, unsigned long id) {
+    struct Dir_index* index = get_ptr(dir->dir_index);
+    struct Dir_bucket* bucket = get_bucket(index, id);
+    if (bucket->depth == index->depth) {
+        if (grow_index(dir) != 0) {
+            return -1;
+        }
+        index = get_ptr(dir->dir_index);
+    }
+
+    struct Dir_bucket* sibling = allocate_bucket(bucket->depth + 1);
+    if (!sibling) {
+        return -1;
+    }
+    unsigned long bit = 1UL << bucket->depth;
+    bucket->depth++;
+
+    int kept = 0;
+    for (int i = 0; i < bucket->count; i++) {
+        if (bucket->entries[i].id & bit)
+            sibling->entries[sibling->count++] = bucket->entries[i];
+        else
+            bucket->entries[kept++] = bucket->entries[i];
+    }
+    bucket->count = kept;
+
+    unsigned long bucket_addr = get_absolute_address(bucket);
+    unsigned long sibling_addr = get_absolute_address(sibling);
+    for (unsigned long i = 0; i < (1UL << index->depth); i++) {
+        if (index->buckets[i] == bucket_addr && (i & bit))
+            index->buckets[i] = sibling_addr;
+    }
+    mark_dirty(bucket, sizeof(struct Dir_bucket));
+    mark_dirty(sibling, sizeof(struct Dir_bucket));
+    mark_dirty(index, index_size(index->depth));
+    return 0;
+}
+
+// Get the address of the directory entry of the file with this id and name, 0 if there is none
+unsigned long dir_index_find(const struct FSFILE* dir, unsigned long id, const char* name) {
+    const struct Dir_index* index = get_ptr(dir->dir_index);
+    if (!index) {
+        return 0;
+    }
+    const struct Dir_bucket* bucket = get_bucket(index, id);
+    for (int i = 0; i < bucket->count; i++) {
+        if (bucket->entries[i].id == id) {
+            const struct Dir_entry* entry = get_ptr(bucket->entries[i].slot);
+            const struct FSFILE* file = get_ptr(entry->file);
+            if (file && is_file_name(file, name))
+                return bucket->entries[i].slot;
+        }
+    }
+    return 0;
+}
+
+int dir_index_insert(struct FSFILE* dir, unsigned long id, unsigned long slot) {
+    struct Dir_index* index = get_ptr(dir->dir_index);
+    if (!index) {
+        return -1;
+    }
+    struct Dir_bucket* bucket = get_bucket(index, id);
+    while (bucket->count == DIR_BUCKET_ENTRIES) {
+        if (split_bucket(dir, id) != 0) {
+            // Ids that can't be told apart by the index: fall back to scanning the directory.
+            // Rebuilding would fail the same way, so that's left until the directory is compacted
+            dir_index_free(dir);
+            dir->unindexed = 1;
+            mark_dirty(dir, TOTAL_FILE_HEADER_SIZE);
+            return -1;
+        }
+        index = get_ptr(dir->dir_index);
+        bucket = get_bucket(index, id);
+    }
+    bucket->entries[bucket->count].id = id;
+    bucket->entries[bucket->count].slot = slot;
+    bucket->count++;
+    mark_dirty(bucket, sizeof(struct Dir_bucket));
+    return 0;
+}
+
+void dir_index_remove(struct FSFILE* dir, unsigned long id, unsigned long slot) {
+    struct Dir_index* index = get_ptr(dir->dir_index);
+    if (!index) {
+        return;
+    }
+    struct Dir_bucket* bucket = get_bucket(index, id);
+    for (int i = 0; i < bucket->count; i++) {
+        if (bucket->entries[i].slot == slot) {
+            bucket->entries[i] = bucket->entries[--bucket->count];
+            mark_dirty(bucket, sizeof(struct Dir_bucket));
+            return;
+        }
+    }
+}
+
+// Index every entry of the directory, except for itself and its parent
+int dir_index_build(struct FSFILE* dir) {
+    struct Dir_index* index = allocate(index_size(0));
+    struct Dir_bucket* bucket = allocate_bucket(0);
+    if (!index || !bucket) {
+        if (index)
+            free_block(get_absolute_address(index), index_size(0), BLOCK_DIR_INDEX);
+        if (bucket)
+            free_block(get_absolute_address(bucket), sizeof(struct Dir_bucket), BLOCK_DIR_BUCKET);
+        return -1;
+    }
+    index->block_type = BLOCK_DIR_INDEX;
+    index->depth = 0;
+    index->buckets[0] = get_absolute_address(bucket);
+    dir->dir_index = get_absolute_address(index);
+    mark_dirty(dir, TOTAL_FILE_HEADER_SIZE);
+
+    int skip = 2;
+    struct Block_cursor cursor;
+    struct Data_block* block = cursor_start(&cursor, dir->first_block);
+    for (; block != NULL; block = cursor_next(&cursor)) {
+        struct Dir_entry* entries = (struct Dir_entry*)get_block_data(block);
+        for (int i = 0; i < block->bytes_used / sizeof(struct Dir_entry); i++) {
+            if (skip) {
+                --skip;
+                continue;
+            }
+            if (entries[i].file && dir_index_insert(dir, entries[i].id, get_absolute_address(&entries[i])) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void dir_index_free(struct FSFILE* dir) {
+    struct Dir_index* index = get_ptr(dir->dir_index);
+    if (!index) {
+        return;
+    }
+    // A bucket shared by several addresses is freed at the first of them
+    unsigned long count = 1UL << index->depth;
+    for (unsigned long i = 0; i < count; i++) {
+        struct Dir_bucket* bucket = get_ptr(index->buckets[i]);
+        if (bucket && (i >> bucket->depth) == 0) {
+            free_block(index->buckets[i], sizeof(struct Dir_bucket), BLOCK_DIR_BUCKET);
+        }
+    }
+    free_block(dir->dir_index, index_size(index->depth), BLOCK_DIR_INDEX);
+    dir->dir_index = 0;
+    mark_dirty(dir, TOTAL_FILE_HEADER_SIZE);
+}
@@ -0,0 +1,320 @@
+// disk.c
+// Backing storage for disks loaded from an image. The image is mapped privately, so only
+// the pages an operation touches are read and nothing reaches the image behind the
+// journal's back. Changed ranges are tracked and written through the journal on sync.
+// Disks live in address space reserved for MAX_DISK_SIZE bytes, so they can grow in place
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "file_system.h"
+#include "disk.h"
+#include "journal.h"
+
+#define GRANULE_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+// Images are written out in pages of this size, and pages that are all zero are skipped
+#define DUMP_PAGE 4096
+
+static int is_granule_dirty(unsigned long granule);
+static unsigned long dirty_words(unsigned long size);
+static unsigned long page_align(unsigned long size);
+static int write_to(int fd, unsigned long from, unsigned long to);
+
+int is_granule_dirty(unsigned long granule) {
+    return (get_state()->dirty[granule / GRANULE_BITS] >> (granule % GRANULE_BITS)) & 1;
+}
+
+// Number of words in the dirty bitmap of a disk of size bytes
+unsigned long dirty_words(unsigned long size) {
+    unsigned long granules = (size + DIRTY_GRANULE - 1) / DIRTY_GRANULE;
+    return (granules + GRANULE_BITS - 1) / GRANULE_BITS;
+}
+
+unsigned long page_align(unsigned long size) {
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Write [from, to) of the disk to the file at fd
+int write_to(int fd, unsigned long from, unsigned long to) {
+    while (from < to) {
+        ssize_t written = pwrite(fd, get_state()->disk + from, to - from, from);
+        if (written <= 0) {
+            return -1;
+        }
+        from += written;
+    }
+    return 0;
+}
+
+// Write [from, to) of the disk to its image
+int write_range(unsigned long from, unsigned long to) {
+    struct FS_state* state = get_state();
+    if (write_to(state->disk_fd, from, to) != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write disk\n", state->disk_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Reserve address space for the disk to grow into, and make the first size bytes of it
+// usable (and zero). If MAX_DISK_SIZE can't be reserved, the disk can't grow
+char* reserve_disk(unsigned long size) {
+    struct FS_state* state = get_state();
+    unsigned long reserved = page_align(size > MAX_DISK_SIZE ? size : MAX_DISK_SIZE);
+    char* disk = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (disk == MAP_FAILED) {
+        reserved = page_align(size);
+        disk = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (disk == MAP_FAILED || mprotect(disk, page_align(size), PROT_READ | PROT_WRITE) != 0) {
+        if (disk != MAP_FAILED)
+            munmap(disk, reserved);
+        error("Failed to allocate memory for disk\n");
+        return NULL;
+    }
+    state->disk = disk;
+    state->reserved_size = reserved;
+    state->mapped_size = size;
+    state->is_mapped = 0;
+    return disk;
+}
+
+// Map the image at path, after replaying its journal. If it can't be mapped the whole
+// image is read into memory instead
+int map_disk(const char* path) {
+    struct FS_state* state = get_state();
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to open disk\n", path);
+        return -1;
+    }
+    // Replaying may cut off journal records that were past the end of the disk
+    struct stat info;
+    if (journal_replay(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(struct FS_disk_header)) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Not a valid disk\n", path);
+        close(fd);
+        return -1;
+    }
+
+    char* disk = reserve_disk(info.st_size);
+    if (!disk) {
+        close(fd);
+        return -1;
+    }
+    state->is_mapped = mmap(disk, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+    for (unsigned long at = 0; !state->is_mapped && at < (unsigned long)info.st_size;) {
+        ssize_t count = pread(fd, disk + at, info.st_size - at, at);
+        if (count <= 0) {
+            error(COLOR_MESSAGE "'%s'" NONE ": Failed to read disk\n", path);
+            munmap(disk, state->reserved_size);
+            state->disk = NULL;
+            close(fd);
+            return -1;
+        }
+        at += count;
+    }
+
+    state->dirty = calloc(dirty_words(info.st_size), sizeof(unsigned long));
+    if (!state->dirty) {
+        error("Failed to allocate memory for disk\n");
+        munmap(disk, state->reserved_size);
+        state->disk = NULL;
+        close(fd);
+        return -1;
+    }
+    state->dirty_low = (info.st_size + DIRTY_GRANULE - 1) / DIRTY_GRANULE;
+    state->dirty_high = 0;
+    state->checkpoint_pending = 0;
+    state->journal_overflow = 0;
+
+    state->disk_fd = fd;
+    state->disk_path = strdup(path);
+    return 0;
+}
+
+// Make the disk size bytes long. The image is extended sparsely, so the new space takes
+// no room on the host until something is written to it
+int extend_disk(unsigned long size) {
+    struct FS_state* state = get_state();
+    if (size <= state->mapped_size) {
+        return 0;
+    }
+    if (size > state->reserved_size) {
+        return -1;
+    }
+    // The new space must not start out with the journal records that overflowed into it
+    if (state->journal_overflow && journal_checkpoint() != 0) {
+        return -1;
+    }
+    if (state->disk_fd >= 0 && ftruncate(state->disk_fd, size) != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to extend disk\n", state->disk_path);
+        return -1;
+    }
+    // The page the disk ended in is mapped already. Past the end of the image it reads as zero
+    unsigned long from = page_align(state->mapped_size);
+    unsigned long to = page_align(size);
+    if (to > from) {
+        int failed = state->is_mapped ?
+            mmap(state->disk + from, to - from, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, state->disk_fd, from) == MAP_FAILED :
+            mprotect(state->disk + from, to - from, PROT_READ | PROT_WRITE) != 0;
+        if (failed) {
+            error("Failed to allocate memory for disk\n");
+            return -1;
+        }
+    }
+
+    if (state->dirty) {
+        unsigned long words = dirty_words(state->mapped_size);
+        unsigned long* dirty = realloc(state->dirty, dirty_words(size) * sizeof(unsigned long));
+        if (!dirty) {
+            error("Failed to allocate memory for disk\n");
+            return -1;
+        }
+        memset(dirty + words, 0, (dirty_words(size) - words) * sizeof(unsigned long));
+        state->dirty = dirty;
+    }
+    state->mapped_size = size;
+    return 0;
+}
+
+void mark_dirty(const void* ptr, unsigned long size) {
+    struct FS_state* state = get_state();
+    if (!state->dirty || size == 0) {
+        return;
+    }
+    unsigned long address = (const char*)ptr - state->disk;
+    unsigned long first = address / DIRTY_GRANULE;
+    unsigned long last = (address + size - 1) / DIRTY_GRANULE;
+    for (unsigned long granule = first; granule <= last; granule++) {
+        state->dirty[granule / GRANULE_BITS] |= (1UL << (granule % GRANULE_BITS));
+    }
+    if (first < state->dirty_low)
+        state->dirty_low = first;
+    if (last + 1 > state->dirty_high)
+        state->dirty_high = last + 1;
+}
+
+// Collect the dirty ranges, coalescing adjacent granules, and clear them
+// The ranges are assigned to (struct Disk_range** ranges), which the caller frees, and their
+// number to (count). If there's no memory for them, nothing is cleared and -1 is returned
+int take_dirty_ranges(struct Disk_range** ranges, unsigned long* count) {
+    struct FS_state* state = get_state();
+    unsigned long capacity = 0;
+    *ranges = NULL;
+    *count = 0;
+
+    unsigned long granule = state->dirty_low;
+    while (granule < state->dirty_high) {
+        if (!is_granule_dirty(granule)) {
+            granule++;
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct Disk_range* grown = realloc(*ranges, capacity * sizeof(struct Disk_range));
+            if (!grown) {
+                // Put back the bits of the ranges taken so far
+                for (unsigned long n = 0; n < *count; n++)
+                    mark_dirty(state->disk + (*ranges)[n].from, (*ranges)[n].to - (*ranges)[n].from);
+                free(*ranges);
+                *ranges = NULL;
+                *count = 0;
+                error("Failed to allocate memory for disk\n");
+                return -1;
+            }
+            *ranges = grown;
+        }
+        unsigned long first = granule;
+        while (granule < state->dirty_high && is_granule_dirty(granule)) {
+            state->dirty[granule / GRANULE_BITS] &= ~(1UL << (granule % GRANULE_BITS));
+            granule++;
+        }
+        (*ranges)[*count].from = first * DIRTY_GRANULE;
+        (*ranges)[*count].to = granule * DIRTY_GRANULE;
+        if ((*ranges)[*count].to > state->mapped_size)
+            (*ranges)[*count].to = state->mapped_size;
+        (*count)++;
+    }
+    state->dirty_low = (state->mapped_size + DIRTY_GRANULE - 1) / DIRTY_GRANULE;
+    state->dirty_high = 0;
+    return 0;
+}
+
+// Write the whole disk to a new image at path. Pages that are all zero are left as holes
+int dump_disk(const char* path) {
+    struct FS_state* state = get_state();
+    unsigned long size = state->disk_header->disk_size;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int failed = fd < 0;
+    for (unsigned long from = 0; !failed && from < size; from += DUMP_PAGE) {
+        unsigned long to = from + DUMP_PAGE < size ? from + DUMP_PAGE : size;
+        const char* page = state->disk + from;
+        if (page[0] == 0 && memcmp(page, page + 1, to - from - 1) == 0)
+            continue;
+        failed = write_to(fd, from, to) != 0;
+    }
+    if (fd >= 0) {
+        failed = failed || ftruncate(fd, size) != 0;
+        close(fd);
+    }
+    if (failed) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write disk\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Whether path is the image the disk was loaded from
+int is_disk_path(const char* path) {
+    struct FS_state* state = get_state();
+    return state->disk_fd >= 0 && state->disk_path && strcmp(state->disk_path, path) == 0;
+}
+
+// Commit everything that changed since the last sync as one journal batch
+int sync_disk() {
+    struct FS_state* state = get_state();
+    if (state->disk_fd < 0 || !state->dirty) {
+        return 0;
+    }
+    struct Disk_range* ranges = NULL;
+    unsigned long count = 0;
+    if (take_dirty_ranges(&ranges, &count) != 0) {
+        return -1;
+    }
+    int result = journal_commit(ranges, count);
+    free(ranges);
+    return result;
+}
+
+void unmap_disk() {
+    struct FS_state* state = get_state();
+    if (state->disk_fd >= 0) {
+        sync_disk();
+        journal_checkpoint();
+    }
+    munmap(state->disk, state->reserved_size);
+    if (state->disk_fd >= 0)
+        close(state->disk_fd);
+    free(state->disk_path);
+    free(state->dirty);
+    state->disk = NULL;
+    state->disk_path = NULL;
+    state->dirty = NULL;
+    state->disk_fd = -1;
+    state->is_mapped = 0;
+    state->journal_overflow = 0;
+    state->mapped_size = 0;
+    state->reserved_size = 0;
+}
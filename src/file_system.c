@@ -5,6 +5,8 @@
 #include "block.h"
 #include "alloc.h"
 #include "dir.h"
+#include "index.h"
+#include "dir_index.h"
 
 static struct FS_state fs_state;
 
@@ -37,7 +39,12 @@ struct FS_state* get_state() {
 	return &fs_state;
 }
 
-struct FSFILE* find_file(struct FSFILE* dir, unsigned long id, unsigned long* location, unsigned long* empty_slot) {
+// Ids are name hashes, so a matching id is confirmed by comparing the name (unless name is NULL)
+int is_file_name(const struct FSFILE* file, const char* name) {
+    return name == NULL || strncmp(file->name, name, FILE_NAME_SIZE) == 0;
+}
+
+struct FSFILE* find_file(struct FSFILE* dir, unsigned long id, const char* name, unsigned long* location, unsigned long* empty_slot) {
     if (!is_initialized()) {
         return NULL;
     }
@@ -50,43 +57,110 @@ struct FSFILE* find_file(struct FSFILE* dir, unsigned long id, unsigned long* lo
         return NULL;
     }
 
-    struct Data_block* block = NULL;
-
-    addr_t next = dir->first_block;
-    if (next == 0)
-        return NULL;
+    if (dir->dir_index) {
+        // Indexed directories append new entries, so there is no empty slot to look for
+        addr_t slot = dir_index_find(dir, id, name);
+        if (slot == 0)
+            return NULL;
+        if (location != NULL)
+            *location = slot;
+        return get_ptr(((struct Dir_entry*)get_ptr(slot))->file);
+    }
 
+    struct Block_cursor cursor;
     int skip = 2;   // Skip the two first files (current and parent directory)
-    struct FSFILE* file = NULL;
-    while ((block = read_block(next)) != NULL) {
-        addr_t* data = (addr_t*)block->data;
-        for (int i = 0; i < block->bytes_used / sizeof(addr_t); i++) {
+    for (struct Data_block* block = cursor_start(&cursor, dir->first_block); block; block = cursor_next(&cursor)) {
+        struct Dir_entry* entries = (struct Dir_entry*)get_block_data(block);
+        for (int i = 0; i < block->bytes_used / sizeof(struct Dir_entry); i++) {
             if (skip) {
                 --skip;
                 continue;
             }
-            addr_t addr = data[i];
-            if (addr == 0) {
-                if (empty_slot) *empty_slot = get_absolute_address(&data[i]);
+            if (entries[i].file == 0) {
+                if (empty_slot) *empty_slot = get_absolute_address(&entries[i]);
                 continue;
             }
-            if ((file = get_ptr(addr))) {
-                if (file->id == id) {
-                    if (location != NULL) {
-                        *location = get_absolute_address(&data[i]);
-                    }
-                    return file;
+            if (entries[i].id == id) {
+                struct FSFILE* file = get_ptr(entries[i].file);
+                if (!file || !is_file_name(file, name))
+                    continue;
+                if (location != NULL) {
+                    *location = get_absolute_address(&entries[i]);
                 }
+                return file;
             }
         }
+    }
 
-        if (block->next == 0) {
-            return NULL;
+    return NULL;
+}
+
+// Holes read as zeros from here
+static const char hole[MAX_BLOCK_SIZE];
+
+static int can_write(const struct FSFILE* file);
+static struct Data_block* get_data_block(unsigned long addr);
+static unsigned long add_blocks(struct FSFILE* file, unsigned long index, unsigned long count);
+static unsigned long fill_holes(struct FSFILE* file, unsigned long index, unsigned long count, unsigned long previous);
+static int extend_data(struct FSFILE* file, unsigned long size);
+
+int can_write(const struct FSFILE* file) {
+    if ((MODE_WRITE != (file->mode & MODE_WRITE) && MODE_APPEND != (file->mode & MODE_APPEND)) && file->type != T_DIR) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write data, file mode (write/append) isn't set\n", file->name);
+        return 0;
+    }
+    return 1;
+}
+
+// Get the block a slot of the block map points at. NULL for holes, and for addresses that
+// aren't data blocks, which are reported
+struct Data_block* get_data_block(unsigned long addr) {
+    if (addr == 0) {
+        return NULL;
+    }
+    struct Data_block* block = get_ptr(addr);
+    if (!block || block->block_type != BLOCK_USED) {
+        error("Broken block map at address " COLOR_NUMBERS "%lu" NONE "\n", addr);
+        return NULL;
+    }
+    return block;
+}
+
+// Allocate count blocks, add them to the block map from block number (index) on and link them
+// to the end of the chain. Slots between the last block and index are left as holes
+// Returns the address of the first new block
+unsigned long add_blocks(struct FSFILE* file, unsigned long index, unsigned long count) {
+    struct Data_block* tail = NULL;
+    struct Data_block* block = allocate_blocks(count, &tail);
+    if (!block) {
+        return 0;
+    }
+    unsigned long addr = get_absolute_address(block);
+
+    // Add the new blocks to the block map before linking them into the chain
+    unsigned long old_count = file->block_count;
+    unsigned long block_index = index;
+    struct Block_cursor cursor;
+    for (block = cursor_start(&cursor, addr); block; block = cursor_next(&cursor)) {
+        if (map_file_block(file, block_index++, cursor.address) != 0) {
+            file->block_count = block_index;
+            truncate_file_index(file, old_count);
+            deallocate_blocks(addr);
+            return 0;
         }
-        next = block->next;
     }
 
-    return NULL;
+    struct Data_block* chain_tail = get_ptr(get_file_block(file, file->block_count - 1));
+    if (chain_tail) {
+        chain_tail->next = addr;
+        mark_dirty(chain_tail, sizeof(struct Data_block));
+    }
+    else {
+        file->first_block = addr;
+    }
+    file->block_count = block_index;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    return addr;
 }
 
 int write_data(const void* data, unsigned long size, struct FSFILE* file) {
@@ -94,98 +168,396 @@ int write_data(const void* data, unsigned long size, struct FSFILE* file) {
         return -1;
     }
 
-    if ((MODE_WRITE != (file->mode & MODE_WRITE) && MODE_APPEND != (file->mode & MODE_APPEND)) && file->type != T_DIR) {
-        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write data, file mode (write/append) isn't set\n");
+    if (!can_write(file)) {
         return -1;
     }
 
+    if (size == 0) {
+        return 0;
+    }
+
+    // Start writing from the last block with data and only allocate the blocks that won't fit
+    // in it or in the blocks reserved after it
+    unsigned long block_size = get_block_size();
+    struct Data_block* last = get_ptr(file->last_block);
+    unsigned long reserved = file->block_count - (file->size + block_size - 1) / block_size;
+    unsigned long bytes_avaliable = (last ? block_size - last->bytes_used : 0) + reserved * block_size;
+    unsigned long start = last ? file->last_block : file->first_block;
+
+    if (size > bytes_avaliable) {
+        unsigned long first = add_blocks(file, file->block_count, (size - bytes_avaliable + block_size - 1) / block_size);
+        if (!first) {
+            return -1;
+        }
+        if (!start) {
+            start = first;
+        }
+    }
+
+    fslog("Writing %lu bytes to file '%s'\n", size, file->name);
     unsigned long bytes_written = 0;
-    
-    if (file->first_block != 0) {
-        struct Data_block* first = get_ptr(file->first_block);
-        if (first) {
-            struct Data_block* last = get_last_block(first);
-            if (last) {
-                unsigned long last_addr = get_absolute_address(last);
-                if (can_access_address(last_addr)) {
-                    if ((BLOCK_SIZE - last->bytes_used) >= size) {
-                        write_to_blocks(file, data, size, &bytes_written, last_addr);
-                    }
-                    else {
-                        int block_count = (size + last->bytes_used) / BLOCK_SIZE + 1;
-                        struct Data_block* block = allocate_blocks(block_count);
-                        if (block) {
-                            unsigned long addr = get_absolute_address(block);
-                            if (can_access_address(addr)) {
-                                unsigned long bytes_written = 0;
-                                write_to_blocks(file, data, size, &bytes_written, addr);
-                                last->next = addr;
-                            }
-                        }
-                    }
-                }
-            }
+    write_to_blocks(file, data, size, &bytes_written, start);
+
+    file->last_block = get_file_block(file, (file->size - 1) / block_size);
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    if (bytes_written != size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Make sure the file can grow to size bytes without allocating. The blocks are
+// allocated at once, so they are as contiguous as the free space allows
+int reserve_data(struct FSFILE* file, unsigned long size) {
+    if (!file || !is_initialized()) {
+        return -1;
+    }
+    unsigned long block_count = (size + get_block_size() - 1) / get_block_size();
+    if (block_count <= file->block_count) {
+        return 0;
+    }
+    return add_blocks(file, file->block_count, block_count - file->block_count) ? 0 : -1;
+}
+
+// Give the holes from block number (index) on blocks, up to count of them, and link them into
+// the chain after the block at previous (0 to look it up). The contents of the new blocks are
+// undefined, so callers zero whatever they don't overwrite
+// Returns the number of holes filled, 0 on failure
+unsigned long fill_holes(struct FSFILE* file, unsigned long index, unsigned long count, unsigned long previous) {
+    struct Map_cursor map;
+    unsigned long holes = 0;
+    for (unsigned long addr = map_cursor_start(&map, file, index); holes < count && addr == 0; addr = map_cursor_next(&map)) {
+        holes++;
+    }
+    struct Data_block* tail = NULL;
+    struct Data_block* first = allocate_blocks(holes, &tail);
+    if (!first) {
+        return 0;
+    }
+    unsigned long first_addr = get_absolute_address(first);
+
+    // Add the new blocks to the block map before linking them into the chain
+    unsigned long n = index;
+    struct Block_cursor cursor;
+    for (struct Data_block* block = cursor_start(&cursor, first_addr); block; block = cursor_next(&cursor)) {
+        if (map_file_block(file, n, cursor.address) != 0) {
+            while (n-- > index)
+                map_file_block(file, n, 0);
+            deallocate_blocks(first_addr);
+            return 0;
         }
+        block->bytes_used = get_block_size();
+        mark_dirty(block, sizeof(struct Data_block));
+        n++;
+    }
+
+    if (previous == 0)
+        previous = find_block_before(file, index);
+    struct Data_block* before = get_ptr(previous);
+    tail->next = before ? before->next : file->first_block;
+    mark_dirty(tail, sizeof(struct Data_block));
+    if (before) {
+        before->next = first_addr;
+        mark_dirty(before, sizeof(struct Data_block));
     }
     else {
-        int block_count = size / BLOCK_SIZE + 1;
-        struct Data_block* block = allocate_blocks(block_count);
-        if (block) {
-            unsigned long bytes_written = 0;
-            unsigned long addr = get_absolute_address(block);
-            write_to_blocks(file, data, size, &bytes_written, addr);
-            file->first_block = addr;
+        file->first_block = first_addr;
+        mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    }
+    return holes;
+}
+
+// Make the file size bytes long. Zeros are written up to the end of the blocks the file already
+// has, past that the gap is left as a hole. Only the block the file ends in is allocated, so
+// that a file never ends in a hole
+int extend_data(struct FSFILE* file, unsigned long size) {
+    static const char zeros[1024] = {0};
+    unsigned long block_size = get_block_size();
+    unsigned long allocated = file->block_count * block_size;
+    while (file->size < size && file->size < allocated) {
+        unsigned long count = (size < allocated ? size : allocated) - file->size;
+        if (count > sizeof(zeros))
+            count = sizeof(zeros);
+        if (write_data(zeros, count, file) != 0) {
+            return -1;
         }
     }
+    if (file->size == size) {
+        return 0;
+    }
 
-    if (bytes_written != size) {
+    unsigned long last = (size - 1) / block_size;
+    struct Data_block* block = get_ptr(add_blocks(file, last, 1));
+    if (!block) {
         return -1;
     }
+    block->bytes_used = size - last * block_size;
+    memset(get_block_data(block), 0, block->bytes_used);
+    mark_dirty(get_block_data(block), block->bytes_used);
+    mark_dirty(block, sizeof(struct Data_block));
+    file->size = size;
+    file->last_block = get_absolute_address(block);
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
     return 0;
 }
 
-// Different cases:
-// - When bytes_used != 0
-// - When the size is less than BLOCK_SIZE - bytes_used
-// - When the size is greater than BLOCK_SIZE - bytes_used but is less than BLOCK_SIZE
-void write_to_blocks(struct FSFILE* file, const void* data, unsigned long size, unsigned long* bytes_written, unsigned long block_addr) {
-    if (size == 0)
-        return;
+// Shrink the file to size bytes and give the blocks past the end back to the allocator
+int truncate_data(struct FSFILE* file, unsigned long size) {
+    if (!file || !is_initialized()) {
+        return -1;
+    }
+    // Shrinking to the current size releases blocks reserved past the end
+    unsigned long keep = (size + get_block_size() - 1) / get_block_size();
+    if (size > file->size || (size == file->size && keep >= file->block_count)) {
+        return 0;
+    }
 
-    if (!can_access_address(block_addr))
-        return;
+    unsigned long first_freed = file->first_block;
+    struct Data_block* last = NULL;
+    if (keep > 0) {
+        // The block the file ends in can't be a hole
+        if (get_file_block(file, keep - 1) == 0) {
+            if (!fill_holes(file, keep - 1, 1, 0)) {
+                return -1;
+            }
+            memset(get_block_data(get_ptr(get_file_block(file, keep - 1))), 0, get_block_size());
+            mark_dirty(get_block_data(get_ptr(get_file_block(file, keep - 1))), get_block_size());
+        }
+        last = get_ptr(get_file_block(file, keep - 1));
+        if (!last) {
+            return -1;
+        }
+        first_freed = last->next;
+        last->next = 0;
+        last->bytes_used = size - (keep - 1) * get_block_size();
+        mark_dirty(last, sizeof(struct Data_block));
+    }
+    if (first_freed != 0 && deallocate_blocks(first_freed) != 0) {
+        return -1;
+    }
 
-    struct Data_block* block = get_ptr(block_addr);
+    truncate_file_index(file, keep);
+    file->first_block = last ? file->first_block : 0;
+    file->last_block = last ? get_absolute_address(last) : 0;
+    file->size = size;
+    if (file->position > size)
+        file->position = size;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    return 0;
+}
 
-    if (!block)
-        return;
+// Write data at any offset of the file. Bytes that are already in the file are
+// overwritten in place, the rest is appended. Holes the data falls in get blocks, and a
+// gap before offset is left as a hole
+int write_data_at(const void* data, unsigned long size, unsigned long offset, struct FSFILE* file) {
+    if (!file || !is_initialized()) {
+        return -1;
+    }
 
-    unsigned long bytes_avaliable = (BLOCK_SIZE - (block->bytes_used));
+    if (!can_write(file)) {
+        return -1;
+    }
 
-    unsigned long bytes_to_write = bytes_avaliable;
+    if (offset > file->size && extend_data(file, offset) != 0) {
+        return -1;
+    }
 
-    if (size <= bytes_avaliable) {
-        bytes_to_write = size;
+    unsigned long block_size = get_block_size();
+    unsigned long end = size < file->size - offset ? offset + size : file->size;
+    unsigned long block_offset = offset % block_size;
+    unsigned long bytes_written = 0;
+    unsigned long previous = 0;     // Last block passed, where filled holes are linked in
+    unsigned long filled = 0;       // Block number after the last hole filled
+    struct Map_cursor map;
+    for (unsigned long addr = map_cursor_start(&map, file, offset / block_size); offset + bytes_written < end; addr = map_cursor_next(&map)) {
+        if (addr == 0) {
+            unsigned long holes = fill_holes(file, map.index, (end - 1) / block_size + 1 - map.index, previous);
+            if (!holes) {
+                return -1;
+            }
+            filled = map.index + holes;
+            addr = map_cursor_start(&map, file, map.index);
+        }
+        struct Data_block* block = get_data_block(addr);
+        if (!block) {
+            return -1;
+        }
+        unsigned long count = block_size - block_offset;
+        if (count > end - offset - bytes_written)
+            count = end - offset - bytes_written;
+        char* block_data = get_block_data(block);
+        if (map.index < filled) {
+            // What isn't overwritten of a filled hole must still read as zeros
+            memset(block_data, 0, block_offset);
+            memset(block_data + block_offset + count, 0, block_size - block_offset - count);
+            mark_dirty(block_data, block_size);
+        }
+        memcpy(block_data + block_offset, (const char*)data + bytes_written, count);
+        mark_dirty(block_data + block_offset, count);
+        bytes_written += count;
+        block_offset = 0;
+        previous = addr;
     }
 
-    // If this block is already filled, go to next one
-    if ((bytes_avaliable == 0) && can_access_address(block->next)) {
-        write_to_blocks(file, data, size, bytes_written, block->next);
-        return;
+    if (bytes_written < size) {
+        return write_data((const char*)data + bytes_written, size - bytes_written, file);
     }
+    return 0;
+}
 
-    fslog("Writing %lu bytes to file '%s'\n", bytes_to_write, file->name);
+// Give the blocks that [offset, offset + size) covers completely back to the allocator, which
+// turns them into holes, and zero the rest of the range. The block the file ends in is only
+// zeroed, so that a file never ends in a hole. The size of the file doesn't change
+int punch_data(struct FSFILE* file, unsigned long offset, unsigned long size) {
+    if (!file || !is_initialized()) {
+        return -1;
+    }
 
-    memcpy(block->data + block->bytes_used, data, bytes_to_write);
-    *bytes_written += bytes_to_write;
-    block->bytes_used += bytes_to_write;
-    file->size += bytes_to_write;
+    if (!can_write(file)) {
+        return -1;
+    }
+
+    if (offset >= file->size || size == 0) {
+        return 0;
+    }
+
+    unsigned long block_size = get_block_size();
+    unsigned long end = size < file->size - offset ? offset + size : file->size;
+    unsigned long last = (file->size - 1) / block_size;
+    unsigned long previous = 0;     // Last block kept, where the chain is relinked
+    int found_previous = 0;
+    unsigned long freed = 0;
+    struct Map_cursor map;
+    for (unsigned long addr = map_cursor_start(&map, file, offset / block_size); map.index * block_size < end; addr = map_cursor_next(&map)) {
+        if (addr == 0) {
+            continue;
+        }
+        struct Data_block* block = get_data_block(addr);
+        if (!block) {
+            return -1;
+        }
+        unsigned long block_start = map.index * block_size;
+        unsigned long from = offset > block_start ? offset - block_start : 0;
+        unsigned long to = end < block_start + block_size ? end - block_start : block_size;
+        if (to - from < block_size || map.index == last) {
+            memset(get_block_data(block) + from, 0, to - from);
+            mark_dirty(get_block_data(block) + from, to - from);
+            previous = addr;
+            found_previous = 1;
+            continue;
+        }
 
-    if (can_access_address(block->next)) {
-        if (size - bytes_to_write > 0) {
-            write_to_blocks(file, data + bytes_to_write, size - bytes_to_write, bytes_written, block->next);
+        if (!found_previous) {
+            previous = find_block_before(file, map.index);
+            found_previous = 1;
         }
+        struct Data_block* before = get_ptr(previous);
+        if (before) {
+            before->next = block->next;
+            mark_dirty(before, sizeof(struct Data_block));
+        }
+        else {
+            file->first_block = block->next;
+        }
+        *map.slot = 0;
+        mark_dirty(map.slot, sizeof(unsigned long));
+        if (free_block(addr, sizeof(struct Data_block), BLOCK_USED) != 0) {
+            return -1;
+        }
+        freed++;
+    }
+
+    if (freed > 0) {
+        prune_file_index(file);
+        fslog("Punched %lu blocks out of file '%s'\n", freed, file->name);
+    }
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    return 0;
+}
+
+// Read up to size bytes from offset into buffer. The block holding offset is found
+// through the block map, so nothing before it is traversed
+// Returns the number of bytes read
+unsigned long read_data(const struct FSFILE* file, unsigned long offset, void* buffer, unsigned long size) {
+    if (!file || !is_initialized() || offset >= file->size) {
+        return 0;
+    }
+    if (size > file->size - offset)
+        size = file->size - offset;
+
+    unsigned long block_size = get_block_size();
+    unsigned long block_offset = offset % block_size;
+    unsigned long bytes_read = 0;
+    struct Map_cursor map;
+    for (unsigned long addr = map_cursor_start(&map, file, offset / block_size); bytes_read < size; addr = map_cursor_next(&map)) {
+        const struct Data_block* block = get_data_block(addr);
+        if (addr != 0 && !block) {
+            break;
+        }
+        unsigned long count = block_size - block_offset;
+        if (count > size - bytes_read)
+            count = size - bytes_read;
+        memcpy((char*)buffer + bytes_read, (block ? get_block_data(block) : hole) + block_offset, count);
+        bytes_read += count;
+        block_offset = 0;
+    }
+    return bytes_read;
+}
+
+// Point spans at the contents of the file from offset on, one span per block, instead of
+// copying them. Holes are spans of zeros. The spans stay valid until the file is changed
+// Returns the number of spans filled, 0 at the end of the file
+unsigned long read_spans(const struct FSFILE* file, unsigned long offset, struct FS_span* spans, unsigned long count) {
+    if (!file || !is_initialized() || offset >= file->size) {
+        return 0;
+    }
+    unsigned long block_size = get_block_size();
+    unsigned long block_offset = offset % block_size;
+    unsigned long remaining = file->size - offset;
+    unsigned long filled = 0;
+    struct Map_cursor map;
+    for (unsigned long addr = map_cursor_start(&map, file, offset / block_size); filled < count && remaining > 0; addr = map_cursor_next(&map)) {
+        const struct Data_block* block = get_data_block(addr);
+        if (addr != 0 && !block) {
+            break;
+        }
+        unsigned long size = block_size - block_offset;
+        if (size > remaining)
+            size = remaining;
+        spans[filled].data = (block ? get_block_data(block) : hole) + block_offset;
+        spans[filled].size = size;
+        filled++;
+        remaining -= size;
+        block_offset = 0;
+    }
+    return filled;
+}
+
+// Append data to the chain from block_addr on, skipping the blocks that are already full
+void write_to_blocks(struct FSFILE* file, const void* data, unsigned long size, unsigned long* bytes_written, unsigned long block_addr) {
+    if (size == 0 || !can_access_address(block_addr))
+        return;
+
+    struct Block_cursor cursor;
+    unsigned long block_size = get_block_size();
+    for (struct Data_block* block = cursor_start(&cursor, block_addr); block && size > 0; block = cursor_next(&cursor)) {
+        unsigned long bytes_to_write = block_size - block->bytes_used;
+        if (bytes_to_write == 0)
+            continue;
+        if (size < bytes_to_write)
+            bytes_to_write = size;
+
+        char* block_data = get_block_data(block);
+        memcpy(block_data + block->bytes_used, data, bytes_to_write);
+        mark_dirty(block_data + block->bytes_used, bytes_to_write);
+        block->bytes_used += bytes_to_write;
+        mark_dirty(block, sizeof(struct Data_block));
+        data = (const char*)data + bytes_to_write;
+        size -= bytes_to_write;
+        *bytes_written += bytes_to_write;
+        file->size += bytes_to_write;
     }
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
 }
 
 void* get_ptr(unsigned long address) {
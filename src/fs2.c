@@ -12,14 +12,20 @@
 #include "block.h"
 #include "alloc.h"
 #include "dir.h"
+#include "dir_index.h"
 #include "error.h"
+#include "disk.h"
+#include "journal.h"
+#include "dentry.h"
+#include "defrag.h"
+#include "host.h"
 
-static int initialize(struct FS_state* state, unsigned long disk_size);
+static int initialize(struct FS_state* state, unsigned long disk_size, unsigned long block_size);
+static int is_valid_block_size(unsigned long block_size);
 
 static int remove_file(const char* path, int file_type);
-static void read_file_contents(unsigned long block_addr, FILE* output);
 
-int initialize(struct FS_state* state, unsigned long disk_size) {
+int initialize(struct FS_state* state, unsigned long disk_size, unsigned long block_size) {
     if (!state) {
         return -1;
     }
@@ -28,7 +34,12 @@ int initialize(struct FS_state* state, unsigned long disk_size) {
 
     state->disk_header = (struct FS_disk_header*)state->disk;
     state->disk_header->magic = HEADER_MAGIC;
+    state->disk_header->version = FS_VERSION;
     state->disk_header->disk_size = sizeof(char) * disk_size;
+    state->disk_header->block_size = block_size;
+    if (allocator_init() != 0 || journal_init() != 0) {
+        return -1;
+    }
     FSFILE* root = fs_create_dir("root");
     if (!root) {
         error("Failed to create root directory\n");
@@ -38,6 +49,11 @@ int initialize(struct FS_state* state, unsigned long disk_size) {
     return 0;
 }
 
+int is_valid_block_size(unsigned long block_size) {
+    // Directory entries must not straddle blocks
+    return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && (block_size % sizeof(struct Dir_entry)) == 0;
+}
+
 int remove_file(const char* path, int file_type) {
     FSFILE* file = NULL;
     FSFILE* dir = get_path_dir(path, &file);
@@ -52,13 +68,15 @@ int remove_file(const char* path, int file_type) {
         return -1;
     }
 
-    addr_t* file_addr = NULL;
-    find_in_dir(dir, file, &file_addr);
-
-    assert(get_absolute_address(file) == *file_addr);
+    struct Dir_entry* entry = NULL;
+    if (find_in_dir(dir, file, &entry) != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE " Failed to remove file\n", path);
+        return -1;
+    }
+    addr_t file_addr = entry->file;
 
     // To make sure you don't delete the directory you are in
-    if (*file_addr == get_state()->disk_header->current_directory || *file_addr == get_state()->disk_header->root_directory) {
+    if (file_addr == get_state()->disk_header->current_directory || file_addr == get_state()->disk_header->root_directory) {
         error("Can't remove this directory\n");
         return -1;
     }
@@ -66,47 +84,23 @@ int remove_file(const char* path, int file_type) {
 		error(COLOR_MESSAGE "'%s/'" NONE ": Directory is not empty\n", file->name);
 		return -1;
 	}
+    dentry_invalidate(get_absolute_address(dir), entry->id, file->name);
+    if (file->type == T_DIR)
+        dentry_invalidate_dir(file_addr);
     if (deallocate_file(file) != 0) {
         return -1;
     }
 
-    if (!file_addr) {
-        error(COLOR_MESSAGE "'%s'" NONE " Failed to remove file\n");
-        return -1;
-    }
-    if (free_block(*file_addr, TOTAL_FILE_HEADER_SIZE, BLOCK_FILE_HEADER) != 0) {
+    if (free_block(file_addr, TOTAL_FILE_HEADER_SIZE, BLOCK_FILE_HEADER) != 0) {
         return -1;
     }
-    fslog("Removed file '%s' (addr: %lu)\n", path, *file_addr);
-    *file_addr = 0;
+    fslog("Removed file '%s' (addr: %lu)\n", path, file_addr);
+    dir_index_remove(dir, entry->id, get_absolute_address(entry));
+    release_dir_entry(dir, entry);
     return 0;
 }
 
-void read_file_contents(unsigned long block_addr, FILE* output) {
-    if (!is_initialized())
-        return;
-
-    if (!can_access_address(block_addr))
-        return;
-
-    if (!output)
-        output = stdout;
-
-    struct Data_block* block = get_ptr(block_addr);
-    if (!block)
-        return;
-
-    fprintf(output, "%.*s", block->bytes_used, block->data);
-    
-    if (block->next == 0) {
-        fprintf(output, "\n");
-        return;
-    }
-    read_file_contents(block->next, output);
-}
-
-
-int fs_init(unsigned long disk_size) {
+int fs_init(unsigned long disk_size, unsigned long block_size) {
     // Mute warnings
     (void)get_size_of_blocks;
     (void)print_block_info;
@@ -115,35 +109,60 @@ int fs_init(unsigned long disk_size) {
     if (is_initialized()) {
         return -1;
     }
-    
-    get_state()->disk = calloc(disk_size, sizeof(char));
-    if (!get_state()->disk) {
-        error("%s: Failed to allocate memory for disk\n", __FUNCTION__);
+
+    if (!is_valid_block_size(block_size)) {
+        error("Invalid block size " COLOR_NUMBERS "%lu" NONE " (must be a multiple of %lu between %i and %i)\n", block_size, sizeof(struct Dir_entry), MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+
+    // Page aligned, so that the data region starts on a cache line in memory as well
+    if (!reserve_disk(disk_size)) {
         return -1;
     }
+    get_state()->disk_fd = -1;
+    get_state()->disk_path = NULL;
+    get_state()->dirty = NULL;
+    get_state()->checkpoint_pending = 0;
+    get_state()->journal_overflow = 0;
 
-    return initialize(get_state(), disk_size);;
+    if (initialize(get_state(), disk_size, block_size) != 0) {
+        // Don't leave a half built disk looking loaded
+        if (is_initialized())
+            fs_free();
+        return -1;
+    }
+    return 0;
 }
 
 int fs_init_from_disk(const char* path) {
     if (is_initialized()) {
         fs_free();
     }
-    char* disk = read_file(path);
-    if (!disk) {
-        error("Failed to allocate memory for disk\n");
+    if (map_disk(path) != 0) {
         return -1;
     }
     get_state()->is_initialized = 1;
     get_state()->log = fopen(DATA_PATH "/log/disk_events.log", "ab");
 
-    get_state()->disk = disk;
     get_state()->disk_header = (struct FS_disk_header*)get_state()->disk;
     if (get_state()->disk_header->magic != HEADER_MAGIC) {
         error("Failed to load disk. Invalid header magic (is: " COLOR_NUMBERS "%i" NONE ", should be: " COLOR_NUMBERS "%i" NONE ").\n", get_state()->disk_header->magic, HEADER_MAGIC);
         return -1;
     }
-    return 0;
+    if (get_state()->disk_header->version != FS_VERSION) {
+        int version = get_state()->disk_header->version ? get_state()->disk_header->version : 1;
+        error("Failed to load disk. It uses layout version " COLOR_NUMBERS "%i" NONE " (should be: " COLOR_NUMBERS "%i" NONE "), convert it with --convert.\n", version, FS_VERSION);
+        return -1;
+    }
+    if (!is_valid_block_size(get_state()->disk_header->block_size)) {
+        error("Failed to load disk. Invalid block size (" COLOR_NUMBERS "%lu" NONE ").\n", get_state()->disk_header->block_size);
+        return -1;
+    }
+    if (get_state()->mapped_size != 0 && get_state()->disk_header->disk_size > get_state()->mapped_size) {
+        error("Failed to load disk. The image is truncated (is: " COLOR_NUMBERS "%lu" NONE " bytes, should be: " COLOR_NUMBERS "%lu" NONE ").\n", get_state()->mapped_size, get_state()->disk_header->disk_size);
+        return -1;
+    }
+    return allocator_load();
 }
 
 FSFILE* fs_open(const char* path, const char* mode) {
@@ -160,19 +179,23 @@ FSFILE* fs_open(const char* path, const char* mode) {
     switch (*mode) {
         case 'w': {
 
-            if ((file = find_file(NULL, id, NULL, NULL))) {
+            if ((file = find_file(NULL, id, path, NULL, NULL))) {
                 if (file->type != T_FILE) {
                     error(COLOR_MESSAGE "'%s'" NONE ": No such file\n", path);
                     return NULL;
                 }
                 deallocate_file(file);
                 file->mode = MODE_WRITE;
+                file->position = 0;
+                mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
                 return file;
             }
             else {
                 file = allocate_file(path, T_FILE);
                 if (file) {
                     file->mode = MODE_WRITE;
+                    file->position = 0;
+                    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
                     return file;
                 }
                 error(COLOR_MESSAGE "'%s'" NONE ": Failed to create file\n", path);
@@ -182,24 +205,28 @@ FSFILE* fs_open(const char* path, const char* mode) {
             break;
 
         case 'r': {
-            FSFILE* file = find_file(NULL, id, NULL, NULL);
+            FSFILE* file = find_file(NULL, id, path, NULL, NULL);
             if (!file) {
                 error(COLOR_MESSAGE "'%s'" NONE ": No such file\n", path);
                 return NULL;
             }
             file->mode = MODE_READ;
+            file->position = 0;
+            mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
             return file;
         
         }
             break;
 
         case 'a': {
-            FSFILE* file = find_file(NULL, id, NULL, NULL);
+            FSFILE* file = find_file(NULL, id, path, NULL, NULL);
             if (!file) {
                 error(COLOR_MESSAGE "'%s'" NONE ": No such file\n", path);
                 return NULL;
             }
             file->mode = MODE_APPEND;
+            file->position = file->size;
+            mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
             return file;
         }
             break;
@@ -216,7 +243,7 @@ FSFILE* fs_open_dir(const char* path) {
         return NULL;
     }
     unsigned long id = hash2(path);
-    FSFILE* file = find_file(NULL, id, NULL, NULL);
+    FSFILE* file = find_file(NULL, id, path, NULL, NULL);
     if (!file) {
         error(COLOR_MESSAGE "'%s'" NONE ": No such directory\n", path);
         return NULL;
@@ -235,10 +262,11 @@ FSFILE* fs_create_dir(const char* path) {
 
     FSFILE* file = allocate_file(path, T_DIR);
     if (file) {
-        unsigned long addr = get_absolute_address(file);
-        fs_write(&addr, sizeof(unsigned long), file);   // self
-        addr_t current = get_state()->disk_header->current_directory;
-        fs_write(current ? &current : &addr,  sizeof(unsigned long), file);   // parent
+        struct Dir_entry self = { .id = file->id, .type = T_DIR, .file = get_absolute_address(file) };
+        fs_write(&self, sizeof(struct Dir_entry), file);
+        struct FSFILE* current = get_ptr(get_state()->disk_header->current_directory);
+        struct Dir_entry parent = current ? (struct Dir_entry) { .id = current->id, .type = T_DIR, .file = get_absolute_address(current) } : self;
+        fs_write(&parent, sizeof(struct Dir_entry), file);
         return file;
     }
     error(COLOR_MESSAGE "'%s'" NONE ": Failed to create directory\n", path);
@@ -260,6 +288,7 @@ int fs_change_dir(const char* path) {
     	return -1;
 
     get_state()->disk_header->current_directory = get_absolute_address(dir);
+    mark_dirty(get_state()->disk_header, sizeof(struct FS_disk_header));
     return 0;
 }
 
@@ -274,11 +303,121 @@ void fs_close(FSFILE* file) {
     }
     if (file->mode != 0) {
         file->mode = 0;
+        mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    }
+    truncate_data(file, file->size);
+}
+
+// Allocate the blocks for a file of size bytes ahead of writing it. Blocks that are
+// still unused when the file is closed are freed
+int fs_reserve(FSFILE* file, unsigned long size) {
+    if (!file || !is_initialized()) {
+        return -1;
     }
+    return reserve_data(file, size);
 }
 
+// Write at the current position of the file (see fs_seek)
 int fs_write(const void* data, unsigned long size, FSFILE* file) {
-    return write_data(data, size, file);
+    if (!file) {
+        return -1;
+    }
+    if (write_data_at(data, size, file->position, file) != 0) {
+        return -1;
+    }
+    file->position += size;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    return 0;
+}
+
+// Read from the current position of the file (see fs_seek)
+// Returns the number of bytes read, 0 at the end of the file
+long fs_read_buf(FSFILE* file, void* buffer, unsigned long size) {
+    if (!file) {
+        return -1;
+    }
+    long count = fs_pread(file, file->position, buffer, size);
+    if (count > 0) {
+        file->position += count;
+        mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    }
+    return count;
+}
+
+long fs_pread(const FSFILE* file, unsigned long offset, void* buffer, unsigned long size) {
+    if (!file || !buffer || !is_initialized()) {
+        return -1;
+    }
+    if (file->type == T_DIR) {
+        error(COLOR_MESSAGE "'%s/'" NONE ": Not a regular file\n", file->name);
+        return -1;
+    }
+    return read_data(file, offset, buffer, size);
+}
+
+// Read without copying: spans are pointed at the contents from offset on, straight in the
+// disk image. They are valid until the file is changed or the disk is freed
+// Returns the number of spans filled, 0 at the end of the file
+long fs_read_spans(const FSFILE* file, unsigned long offset, FS_span* spans, unsigned long count) {
+    if (!file || !spans || !is_initialized()) {
+        return -1;
+    }
+    if (file->type == T_DIR) {
+        error(COLOR_MESSAGE "'%s/'" NONE ": Not a regular file\n", file->name);
+        return -1;
+    }
+    return read_spans(file, offset, spans, count);
+}
+
+long fs_pwrite(FSFILE* file, unsigned long offset, const void* data, unsigned long size) {
+    if (!file || !data || !is_initialized()) {
+        return -1;
+    }
+    if (write_data_at(data, size, offset, file) != 0) {
+        return -1;
+    }
+    return size;
+}
+
+// Free the blocks of [offset, offset + size) of the file. The range reads as zeros afterwards
+// and the size of the file stays the same
+int fs_punch_hole(FSFILE* file, unsigned long offset, unsigned long size) {
+    if (!file || !is_initialized()) {
+        return -1;
+    }
+    if (file->type == T_DIR) {
+        error(COLOR_MESSAGE "'%s/'" NONE ": Not a regular file\n", file->name);
+        return -1;
+    }
+    return punch_data(file, offset, size);
+}
+
+int fs_seek(FSFILE* file, long offset, int whence) {
+    if (!file) {
+        return -1;
+    }
+    long base = 0;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = file->position; break;
+        case SEEK_END: base = file->size; break;
+        default:
+            return -1;
+    }
+    if (base + offset < 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Invalid seek offset\n", file->name);
+        return -1;
+    }
+    file->position = base + offset;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    return 0;
+}
+
+long fs_tell(const FSFILE* file) {
+    if (!file) {
+        return -1;
+    }
+    return file->position;
 }
 
 void fs_print_file_info(const FSFILE* file, FILE* output) {
@@ -287,7 +426,7 @@ void fs_print_file_info(const FSFILE* file, FILE* output) {
     }
     unsigned long addr = get_absolute_address((void*)file);
 
-    fprintf(output, "%-7lu %i %7i ", addr, file->type, file->size);
+    fprintf(output, "%-7lu %i %7lu ", addr, file->type, file->size);
     if (file->type == T_DIR) {
         fprintf(output, COLOR_PATH "%s/", file->name);
     }
@@ -316,10 +455,66 @@ int fs_read(const FSFILE* file, FILE* output) {
         return -1;
     }
 
-    read_file_contents(file->first_block, output);
+    struct FS_span spans[64];
+    unsigned long offset = 0, count;
+    while ((count = read_spans(file, offset, spans, ARRAY_SIZE(spans))) > 0) {
+        for (unsigned long i = 0; i < count; i++) {
+            fwrite(spans[i].data, sizeof(char), spans[i].size, output);
+            offset += spans[i].size;
+        }
+    }
+    fprintf(output, "\n");
     return 0;
 }
 
+// Append everything that can be read from the descriptor to the file, with constant memory
+// Returns the number of bytes written
+long fs_write_fd(FSFILE* file, int fd) {
+    if (!file || !is_initialized()) {
+        return -1;
+    }
+    if (file->type == T_DIR) {
+        error(COLOR_MESSAGE "'%s/'" NONE ": Not a regular file\n", file->name);
+        return -1;
+    }
+    char* buffer = malloc(HOST_CHUNK_SIZE);
+    if (!buffer) {
+        error("Failed to allocate memory\n");
+        return -1;
+    }
+    long written = read_fd_to_file(file, fd, buffer);
+    free(buffer);
+    if (written < 0 && !is_error()) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to read input\n", file->name);
+    }
+    return written;
+}
+
+// Write the exact contents of the file to a descriptor (fs_read is meant for terminals
+// and ends the output with a newline)
+// Returns the number of bytes written
+long fs_read_fd(const FSFILE* file, int fd) {
+    if (!file || !is_initialized()) {
+        return -1;
+    }
+    if (file->type == T_DIR) {
+        error(COLOR_MESSAGE "'%s/'" NONE ": Not a regular file\n", file->name);
+        return -1;
+    }
+    long written = write_file_to_fd(file, fd);
+    if (written < 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write file\n", file->name);
+    }
+    return written;
+}
+
+int fs_defrag(FILE* output) {
+    if (!output || !is_initialized()) {
+        return -1;
+    }
+    return defrag_disk(output);
+}
+
 int fs_list(const char* path, FILE* output) {
     if (!output || !is_initialized()) {
         return -1;
@@ -343,7 +538,7 @@ int fs_list(const char* path, FILE* output) {
     }
     
     fs_pwd(output);
-    return read_dir_contents(dir, dir->first_block, 0, output);
+    return read_dir_contents(dir, output);
 }
 
 void fs_dump_disk(const char* path) {
@@ -351,16 +546,20 @@ void fs_dump_disk(const char* path) {
         return;
     }
 
-    FILE* file = fopen(path, "w");
-    if (file) {
-        fwrite(get_state()->disk, sizeof(char), get_state()->disk_header->disk_size, file);
-        fclose(file);
+    // Only the pages that changed have to be written back to the image the disk was loaded from
+    if (is_disk_path(path)) {
+        sync_disk();
+        return;
     }
+
+    dump_disk(path);
 }
 
 int fs_get_error() {
     if (!is_initialized()) {
-        error("%s\n", "File system is not initialized");
+        if (!is_error())
+            error("%s\n", "File system is not initialized");
+        get_error(stdout);
         return -1;
     }
     return get_error(stdout);
@@ -371,10 +570,11 @@ void fs_free() {
 
     if (get_state()->is_initialized) {
         if (get_state()->disk) {
-            free(get_state()->disk);
-            get_state()->disk = NULL;
+            unmap_disk();
         }
         if (get_state()->log) fclose(get_state()->log);
+        dentry_free();
+        allocator_free();
         get_state()->disk_header = NULL;
         get_state()->is_initialized = 0;
     }
@@ -5,28 +5,55 @@
 
 #include "hash.h"
 
-// djb2
-unsigned long hash(const char* input, unsigned long size) {
-   unsigned long hash_number = 5381;
-   int c;
+#define HASH_SEED 0x9e3779b97f4a7c15UL
+#define HASH_C1 0x87c37b91114253d5UL
+#define HASH_C2 0x4cf5ad432745937fUL
 
-   for (unsigned long i = 0; i < size; i++) {
-      c = input[i];
-      hash_number = ((hash_number << 5) + hash_number) + c;
-   }
+static unsigned long rotate_left(unsigned long x, int bits);
+static unsigned long mix_word(unsigned long word);
+static unsigned long finalize(unsigned long h);
 
-   return hash_number;
+unsigned long rotate_left(unsigned long x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
 }
 
-unsigned long hash2(const char* input) {
-    unsigned long hash_number = 5381;
-    unsigned long size = strlen(input);
-    int c;
+unsigned long mix_word(unsigned long word) {
+    word *= HASH_C1;
+    word = rotate_left(word, 31);
+    return word * HASH_C2;
+}
+
+// Spread every input bit over the whole result
+unsigned long finalize(unsigned long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+// 64-bit hash in the style of MurmurHash3, reading eight bytes at a time
+unsigned long hash(const char* input, unsigned long size) {
+    unsigned long h = HASH_SEED ^ size;
+    unsigned long i = 0;
+
+    for (; i + sizeof(unsigned long) <= size; i += sizeof(unsigned long)) {
+        unsigned long word;
+        memcpy(&word, input + i, sizeof(unsigned long));
+        h ^= mix_word(word);
+        h = rotate_left(h, 27) * 5 + 0x52dce729;
+    }
 
-    for (unsigned long i = 0; i < size; i++) {
-        c = input[i];
-        hash_number = ((hash_number << 5) + hash_number) + c;
+    if (i < size) {
+        unsigned long word = 0;
+        memcpy(&word, input + i, size - i);
+        h ^= mix_word(word);
     }
 
-    return hash_number;
-}
\ No newline at end of file
+    return finalize(h);
+}
+
+unsigned long hash2(const char* input) {
+    return hash(input, strlen(input));
+}
@@ -0,0 +1,399 @@
+// host.c
+// Copies files and directory trees between the host file system and the disk
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "file_system.h"
+#include "block.h"
+#include "file.h"
+#include "dir.h"
+#include "alloc.h"
+#include "error.h"
+#include "fs2.h"
+#include "host.h"
+
+// Number of blocks gathered into one writev call
+#define HOST_IOV_COUNT 1024
+
+struct Import_stats {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long bytes;
+    unsigned long skipped;
+    FILE* output;
+    char* buffer;
+};
+
+static int writev_full(int fd, struct iovec* iov, int count);
+static int is_host_safe_name(const char* name);
+static int export_file(const struct FSFILE* file, const char* host_path, struct Import_stats* stats);
+static int export_dir(const struct FSFILE* dir, const char* host_path, struct Import_stats* stats);
+static int measure_tree(const char* path, unsigned long* bytes);
+static int import_file(const char* host_path, const char* name, struct Import_stats* stats);
+static int import_dir(const char* host_path, struct Import_stats* stats);
+
+// Sum up the size of the regular files in the tree
+int measure_tree(const char* path, unsigned long* bytes) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": No such file or directory on the host\n", path);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        *bytes += st.st_size;
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+
+    DIR* dir = opendir(path);
+    if (!dir) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to open directory\n", path);
+        return -1;
+    }
+    char child[PATH_MAX];
+    struct dirent* entry;
+    int result = 0;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        result = measure_tree(child, bytes);
+    }
+    closedir(dir);
+    return result;
+}
+
+// Stream the host file into a file of the current directory
+int import_file(const char* host_path, const char* name, struct Import_stats* stats) {
+    int fd = open(host_path, O_RDONLY);
+    if (fd < 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to open file\n", host_path);
+        return -1;
+    }
+
+    FSFILE* file = fs_open(name, "w");
+    long count = file ? read_fd_to_file(file, fd, stats->buffer) : -1;
+    if (file && count < 0 && !is_error()) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to read file\n", host_path);
+    }
+    fs_close(file);
+    close(fd);
+    if (count < 0) {
+        return -1;
+    }
+    stats->files++;
+    stats->bytes += count;
+    return 0;
+}
+
+// Import the contents of the host directory into the current directory
+int import_dir(const char* host_path, struct Import_stats* stats) {
+    DIR* dir = opendir(host_path);
+    if (!dir) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to open directory\n", host_path);
+        return -1;
+    }
+
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long current = header->current_directory;
+    char child[PATH_MAX];
+    struct dirent* entry;
+    int result = 0;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", host_path, name);
+
+        struct stat st;
+        if (lstat(child, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            stats->skipped++;
+            continue;
+        }
+        if (strlen(name) >= FILE_NAME_SIZE) {
+            fprintf(stats->output, COLOR_MESSAGE "'%s'" NONE ": Name is too long, skipped\n", child);
+            stats->skipped++;
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode)) {
+            result = import_file(child, name, stats);
+            continue;
+        }
+
+        FSFILE* sub_dir = find_file(NULL, hash2(name), name, NULL, NULL);
+        if (sub_dir && sub_dir->type != T_DIR) {
+            fprintf(stats->output, COLOR_MESSAGE "'%s'" NONE ": A file with this name exists, skipped\n", child);
+            stats->skipped++;
+            continue;
+        }
+        if (!sub_dir) {
+            if (!(sub_dir = fs_create_dir(name))) {
+                result = -1;
+                break;
+            }
+            stats->dirs++;
+        }
+        header->current_directory = get_absolute_address(sub_dir);
+        result = import_dir(child, stats);
+        header->current_directory = current;
+    }
+    closedir(dir);
+    return result;
+}
+
+// Copy a host file, or the contents of a host directory, into the directory dest
+// (the current directory if dest is NULL)
+int import_tree(const char* host_path, const char* dest, FILE* output) {
+    if (!is_initialized()) {
+        return -1;
+    }
+
+    unsigned long bytes = 0;
+    if (measure_tree(host_path, &bytes) != 0) {
+        return -1;
+    }
+    // The disk grows as the files are written, so only what it can't grow into counts against it
+    unsigned long available = get_free_space() + get_growable_space();
+    if (bytes > available) {
+        error("Not enough space to import " COLOR_MESSAGE "'%s'" NONE " (" COLOR_NUMBERS "%lu" NONE " bytes, "
+            COLOR_NUMBERS "%lu" NONE " free)\n", host_path, bytes, available);
+        return -1;
+    }
+
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long current = header->current_directory;
+    if (dest) {
+        FSFILE* file = NULL;
+        FSFILE* dir = get_path_dir(dest, &file);
+        if (!dir || (file && file != dir)) {
+            error(COLOR_MESSAGE "'%s'" NONE ": Not a directory\n", dest);
+            return -1;
+        }
+        header->current_directory = get_absolute_address(dir);
+    }
+
+    struct Import_stats stats = { .output = output, .buffer = malloc(HOST_CHUNK_SIZE) };
+    if (!stats.buffer) {
+        header->current_directory = current;
+        return -1;
+    }
+
+    int result = 0;
+    struct stat st;
+    stat(host_path, &st);
+    if (S_ISDIR(st.st_mode)) {
+        result = import_dir(host_path, &stats);
+    }
+    else {
+        const char* name = strrchr(host_path, '/');
+        name = name ? name + 1 : host_path;
+        if (strlen(name) >= FILE_NAME_SIZE) {
+            error(COLOR_MESSAGE "'%s'" NONE ": Name is too long\n", name);
+            result = -1;
+        }
+        else {
+            result = import_file(host_path, name, &stats);
+        }
+    }
+    free(stats.buffer);
+    header->current_directory = current;
+
+    fprintf(output, "Imported " COLOR_NUMBERS "%lu" NONE " files (" COLOR_NUMBERS "%lu" NONE " bytes) and "
+        COLOR_NUMBERS "%lu" NONE " directories", stats.files, stats.bytes, stats.dirs);
+    if (stats.skipped)
+        fprintf(output, ", skipped " COLOR_NUMBERS "%lu" NONE, stats.skipped);
+    fprintf(output, "\n");
+    return result;
+}
+
+// Append everything that can be read from fd to the file, going through buffer
+// (HOST_CHUNK_SIZE bytes) a chunk at a time. When fd is a regular file the blocks for
+// the rest of it are reserved up front, so the chunks are written into a single run
+// Returns the number of bytes written
+long read_fd_to_file(struct FSFILE* file, int fd, char* buffer) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset >= 0 && st.st_size > offset) {
+            posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+            if (fs_reserve(file, file->size + (st.st_size - offset)) != 0)
+                return -1;
+        }
+    }
+
+    long total = 0;
+    ssize_t count;
+    while ((count = read(fd, buffer, HOST_CHUNK_SIZE)) != 0) {
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 || fs_write(buffer, count, file) != 0)
+            return -1;
+        total += count;
+    }
+    return total;
+}
+
+// Write all of the buffers, continuing after partial writes
+int writev_full(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Write the exact contents of the file to fd. The blocks are handed to writev straight
+// from the disk, a batch at a time, without copying them into a buffer first
+long write_file_to_fd(const struct FSFILE* file, int fd) {
+    struct FS_span spans[HOST_IOV_COUNT];
+    struct iovec iov[HOST_IOV_COUNT];
+    unsigned long offset = 0, count;
+
+    while ((count = read_spans(file, offset, spans, HOST_IOV_COUNT)) > 0) {
+        for (unsigned long i = 0; i < count; i++) {
+            iov[i].iov_base = (void*)spans[i].data;
+            iov[i].iov_len = spans[i].size;
+            offset += spans[i].size;
+        }
+        if (writev_full(fd, iov, count) != 0)
+            return -1;
+    }
+    return offset;
+}
+
+// Whether a name read from the disk can be used as one component of a host path. Names
+// that would lead out of the destination (".", "..", empty or containing '/') can't
+int is_host_safe_name(const char* name) {
+    return *name != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && !strchr(name, '/');
+}
+
+int export_file(const struct FSFILE* file, const char* host_path, struct Import_stats* stats) {
+    int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to create file on the host\n", host_path);
+        return -1;
+    }
+    long written = write_file_to_fd(file, fd);
+    close(fd);
+    if (written < 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write file\n", host_path);
+        return -1;
+    }
+    stats->files++;
+    stats->bytes += written;
+    return 0;
+}
+
+int export_dir(const struct FSFILE* dir, const char* host_path, struct Import_stats* stats) {
+    if (mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to create directory on the host\n", host_path);
+        return -1;
+    }
+    stats->dirs++;
+
+    char child[PATH_MAX];
+    char name[FILE_NAME_SIZE + 1] = {0};
+    unsigned long count = dir->size / sizeof(struct Dir_entry);
+    for (unsigned long i = 2; i < count; i++) {
+        struct Dir_entry* entry = get_dir_entry(dir, i);
+        const struct FSFILE* file = entry ? get_ptr(entry->file) : NULL;
+        if (!file)
+            continue;
+        memcpy(name, file->name, FILE_NAME_SIZE);
+        if (!is_host_safe_name(name)) {
+            fprintf(stats->output, COLOR_MESSAGE "'%s'" NONE ": Entry with an invalid name, skipped\n", name);
+            stats->skipped++;
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", host_path, name);
+        int result = file->type == T_DIR ? export_dir(file, child, stats) : export_file(file, child, stats);
+        if (result != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copy a file or directory tree of the disk to host_path. A file is copied into host_path
+// when that is a host directory. A host_path of "-" writes the file to output
+int export_tree(const char* path, const char* host_path, FILE* output) {
+    if (!is_initialized()) {
+        return -1;
+    }
+    FSFILE* file = NULL;
+    FSFILE* dir = get_path_dir(path, &file);
+    if (!dir) {
+        return -1;
+    }
+    if (!file)
+        file = dir;
+
+    struct Import_stats stats = { .output = output };
+    if (strcmp(host_path, "-") == 0) {
+        if (file->type != T_FILE) {
+            error(COLOR_MESSAGE "'%s'" NONE ": Not a regular file\n", path);
+            return -1;
+        }
+        fflush(output);
+        if (fileno(output) >= 0) {
+            return write_file_to_fd(file, fileno(output)) < 0 ? -1 : 0;
+        }
+        // Streams without a descriptor (like the output of a server request)
+        char buffer[HOST_CHUNK_SIZE];
+        unsigned long offset = 0, count;
+        while ((count = read_data(file, offset, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, sizeof(char), count, output);
+            offset += count;
+        }
+        return 0;
+    }
+
+    int result = 0;
+    if (file->type == T_DIR) {
+        result = export_dir(file, host_path, &stats);
+    }
+    else {
+        char target[PATH_MAX];
+        char name[FILE_NAME_SIZE + 1] = {0};
+        struct stat st;
+        memcpy(name, file->name, FILE_NAME_SIZE);
+        int into_dir = stat(host_path, &st) == 0 && S_ISDIR(st.st_mode);
+        if (into_dir && !is_host_safe_name(name)) {
+            error(COLOR_MESSAGE "'%s'" NONE ": File has an invalid name\n", name);
+            return -1;
+        }
+        if (into_dir)
+            snprintf(target, sizeof(target), "%s/%s", host_path, name);
+        else
+            snprintf(target, sizeof(target), "%s", host_path);
+        result = export_file(file, target, &stats);
+    }
+
+    fprintf(output, "Exported " COLOR_NUMBERS "%lu" NONE " files (" COLOR_NUMBERS "%lu" NONE " bytes) and "
+        COLOR_NUMBERS "%lu" NONE " directories", stats.files, stats.bytes, stats.dirs);
+    if (stats.skipped)
+        fprintf(output, ", skipped " COLOR_NUMBERS "%lu" NONE, stats.skipped);
+    fprintf(output, "\n");
+    return result;
+}
@@ -0,0 +1,232 @@
+// index.c
+// Per-file block map: the first blocks are referenced directly from the file header,
+// the rest through single, double and triple indirect index blocks. When a file grows past
+// what the triple indirect tree can reach, a new index block is put on top of it, with the
+// old tree as its first entry. Slots that are 0 are holes, which read as zeros and take no blocks
+
+#include "file_system.h"
+#include "block.h"
+#include "file.h"
+#include "alloc.h"
+#include "index.h"
+
+static int get_tree_depth(const struct FSFILE* file, int level);
+static int add_tree_level(struct FSFILE* file);
+static unsigned long* find_slot(struct FSFILE* file, unsigned long index, int create);
+static unsigned long* find_slots(const struct FSFILE* file, unsigned long index, unsigned long* from, unsigned long* to);
+static void free_index_block(unsigned long addr, int depth);
+static int prune_index_block(unsigned long* slot, int depth);
+
+// Number of levels of index blocks under the indirect slot of the level, minus one
+int get_tree_depth(const struct FSFILE* file, int level) {
+    return level == FILE_INDIRECT_LEVELS - 1 ? level + file->extra_levels : level;
+}
+
+// Put a new index block on top of the last indirect tree, so that it reaches INDEX_ENTRIES
+// times as many blocks. The blocks it reached keep their numbers
+int add_tree_level(struct FSFILE* file) {
+    unsigned long* root = &file->indirect[FILE_INDIRECT_LEVELS - 1];
+    if (*root) {
+        struct Index_block* index_block = allocate(TOTAL_INDEX_BLOCK_SIZE);
+        if (!index_block) {
+            return -1;
+        }
+        index_block->block_type = BLOCK_INDEX;
+        index_block->entries[0] = *root;
+        *root = get_absolute_address(index_block);
+        mark_dirty(index_block, TOTAL_INDEX_BLOCK_SIZE);
+    }
+    file->extra_levels++;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+    return 0;
+}
+
+// Find the slot holding the address of block number (index) of the file
+// Missing index blocks are allocated on the way down if create is set, and the last tree
+// gets more levels if it doesn't reach that far
+unsigned long* find_slot(struct FSFILE* file, unsigned long index, int create) {
+    if (index < FILE_DIRECT_BLOCKS) {
+        return &file->direct[index];
+    }
+    index -= FILE_DIRECT_BLOCKS;
+
+    unsigned long span = INDEX_ENTRIES; // Number of blocks reachable from this level
+    for (int level = 0; level < FILE_INDIRECT_LEVELS; level++, span *= INDEX_ENTRIES) {
+        if (level == FILE_INDIRECT_LEVELS - 1) {
+            for (int extra = 0; extra < file->extra_levels; extra++)
+                span *= INDEX_ENTRIES;
+            while (create && index >= span && span <= ULONG_MAX / INDEX_ENTRIES) {
+                if (add_tree_level(file) != 0) {
+                    return NULL;
+                }
+                span *= INDEX_ENTRIES;
+            }
+        }
+        if (index >= span) {
+            index -= span;
+            continue;
+        }
+        unsigned long* slot = &file->indirect[level];
+        for (unsigned long stride = span / INDEX_ENTRIES; ; stride /= INDEX_ENTRIES) {
+            struct Index_block* index_block = get_ptr(*slot);
+            if (!index_block) {
+                if (!create || !(index_block = allocate(TOTAL_INDEX_BLOCK_SIZE))) {
+                    return NULL;
+                }
+                index_block->block_type = BLOCK_INDEX;
+                *slot = get_absolute_address(index_block);
+                mark_dirty(slot, sizeof(unsigned long));
+            }
+            slot = &index_block->entries[index / stride];
+            index %= stride;
+            if (stride == 1) {
+                return slot;
+            }
+        }
+    }
+    error(COLOR_MESSAGE "'%s'" NONE ": File is too large\n", file->name);
+    return NULL;
+}
+
+// Find the slot of block number (index) without allocating anything, and assign the range of
+// block numbers whose slots are next to it, in the header or in the same index block, to [from, to)
+// Returns NULL if the index block isn't there
+unsigned long* find_slots(const struct FSFILE* file, unsigned long index, unsigned long* from, unsigned long* to) {
+    if (index < FILE_DIRECT_BLOCKS) {
+        *from = 0;
+        *to = FILE_DIRECT_BLOCKS;
+    }
+    else {
+        // Every indirect level starts at a multiple of INDEX_ENTRIES past the direct blocks
+        *from = index - (index - FILE_DIRECT_BLOCKS) % INDEX_ENTRIES;
+        *to = *from + INDEX_ENTRIES;
+    }
+    return find_slot((struct FSFILE*)file, index, 0);
+}
+
+unsigned long map_cursor_start(struct Map_cursor* cursor, const struct FSFILE* file, unsigned long index) {
+    unsigned long from;
+    cursor->file = file;
+    cursor->index = index;
+    cursor->slot = find_slots(file, index, &from, &cursor->to);
+    return cursor->slot ? *cursor->slot : 0;
+}
+
+unsigned long map_cursor_next(struct Map_cursor* cursor) {
+    cursor->index++;
+    if (cursor->index >= cursor->to) {
+        return map_cursor_start(cursor, cursor->file, cursor->index);
+    }
+    if (cursor->slot) {
+        cursor->slot++;
+        return *cursor->slot;
+    }
+    return 0;
+}
+
+// Get the address of the last block before block number (index), 0 if there is none.
+// Index blocks that aren't there are skipped as a whole
+unsigned long find_block_before(const struct FSFILE* file, unsigned long index) {
+    while (index > 0) {
+        unsigned long from, to;
+        unsigned long* slot = find_slots(file, index - 1, &from, &to);
+        for (; slot && index > from; index--, slot--) {
+            if (*slot != 0)
+                return *slot;
+        }
+        index = from;
+    }
+    return 0;
+}
+
+// Get the address of block number (index) of the file, 0 if it has no such block
+unsigned long get_file_block(const struct FSFILE* file, unsigned long index) {
+    if (index >= file->block_count) {
+        return 0;
+    }
+    unsigned long* slot = find_slot((struct FSFILE*)file, index, 0);
+    return slot ? *slot : 0;
+}
+
+int map_file_block(struct FSFILE* file, unsigned long index, unsigned long block_addr) {
+    unsigned long* slot = find_slot(file, index, 1);
+    if (!slot) {
+        return -1;
+    }
+    *slot = block_addr;
+    mark_dirty(slot, sizeof(unsigned long));
+    return 0;
+}
+
+void free_index_block(unsigned long addr, int depth) {
+    struct Index_block* index_block = get_ptr(addr);
+    if (!index_block) {
+        return;
+    }
+    if (depth > 0) {
+        for (int i = 0; i < INDEX_ENTRIES; i++) {
+            free_index_block(index_block->entries[i], depth - 1);
+        }
+    }
+    free_block(addr, TOTAL_INDEX_BLOCK_SIZE, BLOCK_INDEX);
+}
+
+// Free the index block in slot if none of its entries are used anymore
+// Returns 1 if the slot is empty afterwards
+int prune_index_block(unsigned long* slot, int depth) {
+    struct Index_block* index_block = get_ptr(*slot);
+    if (!index_block) {
+        return 1;
+    }
+    int used = 0;
+    for (int i = 0; i < INDEX_ENTRIES; i++) {
+        if (depth > 0 ? !prune_index_block(&index_block->entries[i], depth - 1) : index_block->entries[i] != 0)
+            used = 1;
+    }
+    if (used) {
+        return 0;
+    }
+    free_block(*slot, TOTAL_INDEX_BLOCK_SIZE, BLOCK_INDEX);
+    *slot = 0;
+    mark_dirty(slot, sizeof(unsigned long));
+    return 1;
+}
+
+// Free the index blocks that only map holes
+void prune_file_index(struct FSFILE* file) {
+    if (file->block_count > FILE_DIRECT_BLOCKS) {
+        for (int level = 0; level < FILE_INDIRECT_LEVELS; level++) {
+            prune_index_block(&file->indirect[level], get_tree_depth(file, level));
+        }
+        if (file->indirect[FILE_INDIRECT_LEVELS - 1] == 0 && file->extra_levels > 0) {
+            file->extra_levels = 0;
+            mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+        }
+    }
+}
+
+// Forget every block from number (count) on, freeing index blocks that become unused
+void truncate_file_index(struct FSFILE* file, unsigned long count) {
+    struct Map_cursor cursor;
+    for (map_cursor_start(&cursor, file, count); cursor.index < file->block_count; map_cursor_next(&cursor)) {
+        if (cursor.slot && *cursor.slot != 0) {
+            *cursor.slot = 0;
+            mark_dirty(cursor.slot, sizeof(unsigned long));
+        }
+    }
+    prune_file_index(file);
+    if (count < file->block_count)
+        file->block_count = count;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+}
+
+void free_file_index(struct FSFILE* file) {
+    for (int level = 0; level < FILE_INDIRECT_LEVELS; level++) {
+        free_index_block(file->indirect[level], get_tree_depth(file, level));
+        file->indirect[level] = 0;
+    }
+    file->extra_levels = 0;
+    memset(file->direct, 0, sizeof(file->direct));
+    file->block_count = 0;
+    mark_dirty(file, TOTAL_FILE_HEADER_SIZE);
+}
@@ -0,0 +1,319 @@
+// journal.c
+// Write-ahead journal. On sync every changed range is first written to the journal
+// region of the disk as a redo record, and the whole batch is committed with a single
+// fdatasync. Only then are the ranges written to their home locations. Committed
+// batches that may not have made it home are replayed the next time the disk is loaded.
+// A batch is never split: when its records don't fit in the journal they are written past
+// the end of the image, and the journal only points at them
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "file_system.h"
+#include "alloc.h"
+#include "journal.h"
+
+#define RECORD_ALIGN 8
+
+static unsigned long record_size(unsigned long size);
+static int read_all(int fd, void* data, unsigned long size, unsigned long offset);
+static int write_all(int fd, const void* data, unsigned long size, unsigned long offset);
+static unsigned long page_align(unsigned long size);
+static unsigned long pack_records(const struct Disk_range* ranges, unsigned long count, char* records);
+
+unsigned long record_size(unsigned long size) {
+    return sizeof(struct Journal_record) + ((size + RECORD_ALIGN - 1) / RECORD_ALIGN) * RECORD_ALIGN;
+}
+
+int read_all(int fd, void* data, unsigned long size, unsigned long offset) {
+    while (size > 0) {
+        ssize_t count = pread(fd, data, size, offset);
+        if (count <= 0) {
+            return -1;
+        }
+        data = (char*)data + count;
+        size -= count;
+        offset += count;
+    }
+    return 0;
+}
+
+int write_all(int fd, const void* data, unsigned long size, unsigned long offset) {
+    while (size > 0) {
+        ssize_t count = pwrite(fd, data, size, offset);
+        if (count <= 0) {
+            return -1;
+        }
+        data = (const char*)data + count;
+        size -= count;
+        offset += count;
+    }
+    return 0;
+}
+
+unsigned long page_align(unsigned long size) {
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Write a record for each of the ranges to records, leaving out the journal region, which
+// is written on its own (ranges are tracked in granules, so they can reach into it)
+// Returns the length of the records. If records is NULL they are only measured
+unsigned long pack_records(const struct Disk_range* ranges, unsigned long count, char* records) {
+    struct FS_state* state = get_state();
+    unsigned long journal = state->disk_header->journal;
+    unsigned long journal_end = journal + state->disk_header->journal_size;
+    unsigned long length = 0;
+    for (unsigned long i = 0; i < count; i++) {
+        unsigned long pieces[2][2] = {
+            { ranges[i].from, ranges[i].to < journal ? ranges[i].to : journal },
+            { ranges[i].from > journal_end ? ranges[i].from : journal_end, ranges[i].to }
+        };
+        for (int n = 0; n < 2; n++) {
+            unsigned long from = pieces[n][0];
+            unsigned long to = pieces[n][1];
+            if (from >= to)
+                continue;
+            if (records) {
+                struct Journal_record* record = (struct Journal_record*)(records + length);
+                record->address = from;
+                record->size = to - from;
+                memcpy(record->data, state->disk + from, to - from);
+            }
+            length += record_size(to - from);
+        }
+    }
+    return length;
+}
+
+// Reserve the journal region when the disk is created
+int journal_init() {
+    struct FS_disk_header* header = get_state()->disk_header;
+    unsigned long size = header->disk_size / JOURNAL_FRACTION;
+    if (size < JOURNAL_MIN_SIZE)
+        size = JOURNAL_MIN_SIZE;
+    if (size > JOURNAL_MAX_SIZE)
+        size = JOURNAL_MAX_SIZE;
+
+    size -= size % (2 * RECORD_ALIGN);
+
+    char* journal = allocate(size);
+    if (!journal) {
+        error("Failed to allocate journal\n");
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct Journal_header* half = (struct Journal_header*)(journal + i * (size / 2));
+        half->magic = JOURNAL_MAGIC;
+        half->state = JOURNAL_EMPTY;
+        mark_dirty(half, sizeof(struct Journal_header));
+    }
+    header->journal = get_absolute_address(journal);
+    header->journal_size = size;
+    mark_dirty(header, sizeof(struct FS_disk_header));
+    return 0;
+}
+
+// Apply the committed batches left in the journal of the image, oldest first
+// Runs before the image is mapped
+int journal_replay(int fd) {
+    struct FS_disk_header header;
+    struct stat info;
+    if (read_all(fd, &header, sizeof(header), 0) != 0 || header.magic != HEADER_MAGIC || header.journal == 0 ||
+        fstat(fd, &info) != 0) {
+        return 0;
+    }
+
+    unsigned long half_size = header.journal_size / 2;
+    struct Journal_header halves[2];
+    for (int i = 0; i < 2; i++) {
+        if (read_all(fd, &halves[i], sizeof(struct Journal_header), header.journal + i * half_size) != 0) {
+            return 0;
+        }
+    }
+    if (halves[0].state != JOURNAL_COMMITTED && halves[0].state != JOURNAL_OVERFLOWED &&
+        halves[1].state != JOURNAL_COMMITTED && halves[1].state != JOURNAL_OVERFLOWED) {
+        return 0;
+    }
+
+    unsigned long image_end = info.st_size;    // Where the disk ends, without overflowed records
+    int first = halves[0].sequence <= halves[1].sequence ? 0 : 1;
+    for (int n = 0; n < 2; n++) {
+        int i = (first + n) % 2;
+        struct Journal_header* journal = &halves[i];
+        unsigned long records_addr = header.journal + i * half_size + sizeof(struct Journal_header);
+        unsigned long records_end = records_addr - sizeof(struct Journal_header) + half_size;
+        if (journal->magic != JOURNAL_MAGIC || (journal->state != JOURNAL_COMMITTED && journal->state != JOURNAL_OVERFLOWED)) {
+            continue;
+        }
+        if (journal->state == JOURNAL_OVERFLOWED) {
+            if (read_all(fd, &records_addr, sizeof(unsigned long), records_addr) != 0 ||
+                records_addr > (unsigned long)info.st_size) {
+                continue;
+            }
+            records_end = info.st_size;
+        }
+        if (journal->length > records_end - records_addr) {
+            continue;
+        }
+
+        // A batch with a bad checksum was torn while it was being committed. None of its
+        // ranges were written home yet, so it's simply dropped
+        char* records = malloc(journal->length);
+        if (!records || read_all(fd, records, journal->length, records_addr) != 0 ||
+            hash(records, journal->length) != journal->checksum) {
+            free(records);
+            continue;
+        }
+        if (journal->state == JOURNAL_OVERFLOWED && records_addr < image_end)
+            image_end = records_addr;
+        for (unsigned long at = 0; at < journal->length;) {
+            struct Journal_record* record = (struct Journal_record*)(records + at);
+            // The image is extended before a batch that grows the disk is committed, so records
+            // may be past the end of the disk the header at home describes
+            if (record->address + record->size > (unsigned long)info.st_size ||
+                write_all(fd, record->data, record->size, record->address) != 0) {
+                error("Failed to replay journal\n");
+                free(records);
+                return -1;
+            }
+            at += record_size(record->size);
+        }
+        free(records);
+    }
+    if (fdatasync(fd) != 0) {
+        error("Failed to replay journal\n");
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        halves[i].state = JOURNAL_EMPTY;
+        if (write_all(fd, &halves[i], sizeof(struct Journal_header), header.journal + i * half_size) != 0) {
+            return -1;
+        }
+    }
+    // The batches are home, so records past the end of the disk aren't needed anymore
+    if (image_end < (unsigned long)info.st_size && ftruncate(fd, image_end) != 0) {
+        error("Failed to replay journal\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Commit the ranges through the journal and write them home
+// The journal is split in two halves used in turn. Before a half is reused, the batch
+// it held has already been made durable at home by the fdatasync that committed the
+// batch in the other half, so each batch only needs one fdatasync
+// A batch that doesn't fit in a half is written past the end of the image instead, and the
+// half only holds its address. It's committed by the same single fdatasync
+int journal_commit(const struct Disk_range* ranges, unsigned long count) {
+    struct FS_state* state = get_state();
+    struct FS_disk_header* header = state->disk_header;
+
+    if (!get_ptr(header->journal)) {
+        for (unsigned long i = 0; i < count; i++) {
+            if (write_range(ranges[i].from, ranges[i].to) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    unsigned long length = pack_records(ranges, count, NULL);
+    if (length == 0) {
+        return 0;
+    }
+
+    unsigned long half_size = header->journal_size / 2;
+    unsigned long capacity = half_size - sizeof(struct Journal_header);
+    struct Journal_header* halves[2] = {
+        get_ptr(header->journal),
+        get_ptr(header->journal + half_size)
+    };
+    unsigned long sequence = (halves[0]->sequence > halves[1]->sequence ? halves[0]->sequence : halves[1]->sequence) + 1;
+    struct Journal_header* journal = halves[sequence % 2];
+    char* records = (char*)(journal + 1);
+    unsigned long overflow = 0;
+
+    if (length > capacity) {
+        // Records left past the end by an earlier batch may still be needed to replay it, so
+        // that batch is made durable at home before they are overwritten
+        if (state->journal_overflow && journal_checkpoint() != 0) {
+            return -1;
+        }
+        if (!(records = malloc(length))) {
+            error("Failed to allocate memory for journal\n");
+            return -1;
+        }
+        overflow = page_align(state->mapped_size);
+    }
+    pack_records(ranges, count, records);
+
+    journal->magic = JOURNAL_MAGIC;
+    journal->state = overflow ? JOURNAL_OVERFLOWED : JOURNAL_COMMITTED;
+    journal->sequence = sequence;
+    journal->length = length;
+    journal->checksum = hash(records, length);
+    unsigned long journal_addr = get_absolute_address(journal);
+    unsigned long journal_length = sizeof(struct Journal_header) + length;
+    if (overflow) {
+        *(unsigned long*)(journal + 1) = overflow;
+        journal_length = sizeof(struct Journal_header) + sizeof(unsigned long);
+    }
+    if ((overflow && write_all(state->disk_fd, records, length, overflow) != 0) ||
+        write_range(journal_addr, journal_addr + journal_length) != 0 ||
+        fdatasync(state->disk_fd) != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to commit journal\n", state->disk_path);
+        if (overflow)
+            free(records);
+        return -1;
+    }
+
+    int result = 0;
+    for (unsigned long at = 0; result == 0 && at < length;) {
+        struct Journal_record* record = (struct Journal_record*)(records + at);
+        result = write_range(record->address, record->address + record->size);
+        at += record_size(record->size);
+    }
+    if (overflow) {
+        free(records);
+        state->journal_overflow = overflow;
+    }
+    state->checkpoint_pending = 1;
+    return result;
+}
+
+// Make the home writes of the last batches durable and mark the journal as empty
+int journal_checkpoint() {
+    struct FS_state* state = get_state();
+    struct FS_disk_header* header = state->disk_header;
+    if (!state->checkpoint_pending || !get_ptr(header->journal)) {
+        return 0;
+    }
+    if (fdatasync(state->disk_fd) != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to write disk\n", state->disk_path);
+        return -1;
+    }
+    state->checkpoint_pending = 0;
+
+    unsigned long half_size = header->journal_size / 2;
+    for (int i = 0; i < 2; i++) {
+        unsigned long journal_addr = header->journal + i * half_size;
+        struct Journal_header* journal = get_ptr(journal_addr);
+        journal->state = JOURNAL_EMPTY;
+        if (write_range(journal_addr, journal_addr + sizeof(struct Journal_header)) != 0) {
+            return -1;
+        }
+    }
+    // The batches are home, so the records past the end of the disk can go
+    if (state->journal_overflow) {
+        if (ftruncate(state->disk_fd, state->mapped_size) != 0) {
+            error(COLOR_MESSAGE "'%s'" NONE ": Failed to write disk\n", state->disk_path);
+            return -1;
+        }
+        state->journal_overflow = 0;
+    }
+    return 0;
+}
@@ -1,13 +1,23 @@
 // main.c
 
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <argp.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
 
 #include "fs2.h"
+#include "batch.h"
+#include "host.h"
+#include "read.h"
+#include "server.h"
+#include "client.h"
+#include "convert.h"
 
 static char args_doc[] = "";
 static char doc[] = "File System 2 (fs2) - file system emulator";
@@ -22,48 +32,240 @@ static struct argp_option options[] = {
   {"list",       'l', "file",      OPTION_ARG_OPTIONAL,  "List directory contents"},
   {"write",      'w', "file",      0,  "Write data to file"},
   {"append",     'a', "file",      0,  "Append data to file"},
+  {"write-from", 'W', "file",      0,  "Write the contents of the host file given after it to file (stdin when there is none or it's -)"},
+  {"append-from", 'A', "file",     0,  "Append the contents of the host file given after it to file (stdin when there is none or it's -)"},
   {"info",       'i', "file",      0,  "Print file info"},
   {"options",    'o', 0,           0,  "Get all options"},
   {"pwd",        'p', 0,		   0,  "Print working directory"},
+  {"disk-size",  's', "size",      0,  "Initial size of disks created by --format, which grow as needed (K, M and G suffixes are allowed)"},
+  {"block-size", 'b', "size",      0,  "Block size of disks created by --format"},
+  {"format",     'f', 0,           0,  "Create a new empty disk"},
+  {"defrag",     'D', 0,           0,  "Make the blocks of every file contiguous"},
+  {"convert",    'C', 0,           0,  "Rewrite a disk of an older layout version in the current one"},
+  {"batch",      'B', "file",      0,  "Run the operations listed in file (- for stdin) on one loaded disk"},
+  {"serve",      'S', "socket",    0,  "Keep the disk loaded and serve operations on socket (clients look for it at $" SOCKET_PATH_ENV " or the default path)"},
+  {"stop",       'Q', 0,           0,  "Stop the running server"},
+  {"import",     'I', "hostdir",   0,  "Copy a host file or the contents of hostdir into the current directory (or the directory given after it)"},
+  {"export",     'E', "file",      0,  "Copy a file or directory to the host path given after it (- writes the exact contents of a file to stdout)"},
   { 0 }
 };
 
 struct Arguments {
     int silent, verbose;
     FILE* output_file;
+    const char* disk_path;
+    int disk_loaded;
+    unsigned long disk_size;
+    unsigned long block_size;
+    int server;     // Connection to a running server, -1 when operations run on a disk loaded here
 };
 
+// Options that operate on the disk, which is loaded the first time one of them is used
+static const char disk_options[] = "crdxvlwaWAipDBSIE";
+// Options that are sent to the server instead when one is running
+static const char server_options[] = "crdxvlwaWAipDBfQIE";
+
 static error_t parse_option(int key, char *arg, struct argp_state *state);
+static int load_disk(struct Arguments* arguments);
+static int forward_option(struct Arguments* arguments, int key, char* arg, int arg_count, char** args);
+static unsigned long parse_size(const char* str);
+static char* resolve_host_path(const char* path, char* resolved);
+static int open_input(int arg_count, char** args);
 
 int main(int argc, char** argv) {
     struct argp argp = {options, parse_option, args_doc, doc};
     struct Arguments arguments = {
         .silent = 0,
         .verbose = 1,
-        .output_file = stdout
+        .output_file = stdout,
+        .disk_path = DATA_PATH "/data/test.disk",
+        .disk_loaded = 0,
+        .disk_size = DEFAULT_DISK_SIZE,
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .server = -1
     };
 
-    char* disk_path = DATA_PATH "/data/test.disk";
-
     if (argc > 1) {
-        fs_init_from_disk(disk_path);
-        if (fs_get_error() != 0) return -1;
-        argp_parse(&argp, argc, argv, 0, 0, &arguments);
-        fs_dump_disk(disk_path);
+        arguments.server = client_connect(get_socket_path());
+        int result = argp_parse(&argp, argc, argv, 0, 0, &arguments);
+        if (arguments.server >= 0)
+            close(arguments.server);
+        if (result != 0) return -1;
+        if (arguments.disk_loaded) {
+            fs_dump_disk(arguments.disk_path);
+            fs_free();
+        }
+    }
+    else if ((arguments.server = client_connect(get_socket_path())) >= 0) {
+        int result = forward_option(&arguments, 'f', NULL, 0, NULL);
+        close(arguments.server);
+        if (result != 0) return -1;
     }
     else {
-        fs_init(DEFAULT_DISK_SIZE); // Create an empty disk
+        fs_init(DEFAULT_DISK_SIZE, DEFAULT_BLOCK_SIZE); // Create an empty disk
         if (fs_get_error() != 0) return -1;
-        fs_dump_disk(disk_path);
+        fs_dump_disk(arguments.disk_path);
     }
     return 0;
 }
 
+int load_disk(struct Arguments* arguments) {
+    if (arguments->disk_loaded)
+        return 0;
+    fs_init_from_disk(arguments->disk_path);
+    if (fs_get_error() != 0) return -1;
+    arguments->disk_loaded = 1;
+    return 0;
+}
+
+// Run the option on the server, which prints the same output the option would print here
+int forward_option(struct Arguments* arguments, int key, char* arg, int arg_count, char** args) {
+    FILE* output = arguments->output_file;
+    int server = arguments->server;
+    const char* data = arg_count > 0 ? args[0] : NULL;
+
+    switch (key) {
+        case 'c': return client_request(server, OP_CREATE, arg, NULL, 0, output);
+        case 'r': return client_request(server, OP_READ, arg, NULL, 0, output);
+        case 'd': return client_request(server, OP_MKDIR, arg, NULL, 0, output);
+        case 'x': return client_request(server, OP_REMOVE, arg, NULL, 0, output);
+        case 'v': return client_request(server, OP_CHDIR, arg, NULL, 0, output);
+        case 'i': return client_request(server, OP_INFO, arg, NULL, 0, output);
+        case 'l': return client_request(server, OP_LIST, data, NULL, 0, output);
+        case 'w': return client_request(server, OP_WRITE, arg, data, data ? strlen(data) : 0, output);
+        case 'a': return client_request(server, OP_APPEND, arg, data, data ? strlen(data) : 0, output);
+        case 'p': return client_request(server, OP_PWD, NULL, NULL, 0, output);
+        case 'D': return client_request(server, OP_DEFRAG, NULL, NULL, 0, output);
+        case 'Q': return client_request(server, OP_SHUTDOWN, NULL, NULL, 0, output);
+
+        case 'W':
+        case 'A': {
+            int fd = open_input(arg_count, args);
+            if (fd < 0)
+                return -1;
+            int result = client_request_fd(server, key == 'A' ? OP_APPEND_FD : OP_WRITE_FD, arg, fd, output);
+            if (fd != STDIN_FILENO)
+                close(fd);
+            return result;
+        }
+
+        case 'B': {
+            FILE* input = strcmp(arg, "-") == 0 ? stdin : fopen(arg, "r");
+            unsigned long size = 0;
+            char* batch = input ? read_stream(input, &size) : NULL;
+            if (input && input != stdin)
+                fclose(input);
+            if (!batch) {
+                printf("'%s': Failed to read batch file\n", arg);
+                return -1;
+            }
+            int result = client_request(server, OP_BATCH, NULL, batch, size, output);
+            free(batch);
+            return result;
+        }
+
+        case 'I': {
+            // The server doesn't share our working directory
+            char host_path[PATH_MAX];
+            if (!realpath(arg, host_path)) {
+                printf("'%s': No such file or directory on the host\n", arg);
+                return -1;
+            }
+            return client_request(server, OP_IMPORT, host_path, data, data ? strlen(data) : 0, output);
+        }
+
+        case 'E': {
+            if (!data) {
+                printf("'%s': Missing host path\n", arg);
+                return -1;
+            }
+            char host_path[PATH_MAX];
+            if (strcmp(data, "-") == 0) {
+                strcpy(host_path, data);
+            }
+            else if (!resolve_host_path(data, host_path)) {
+                printf("'%s': Invalid host path\n", data);
+                return -1;
+            }
+            return client_request(server, OP_EXPORT, arg, host_path, strlen(host_path), output);
+        }
+
+        case 'f': {
+            unsigned long sizes[2] = {arguments->disk_size, arguments->block_size};
+            return client_request(server, OP_FORMAT, NULL, sizes, sizeof(sizes), output);
+        }
+
+        default:
+            return 0;
+    }
+}
+
+// Open the host file given after --write-from or --append-from, or stdin
+int open_input(int arg_count, char** args) {
+    if (arg_count == 0 || strcmp(args[0], "-") == 0)
+        return STDIN_FILENO;
+    int fd = open(args[0], O_RDONLY);
+    if (fd < 0)
+        printf("'%s': No such file on the host\n", args[0]);
+    return fd;
+}
+
+// Make a host path absolute for the server, which doesn't share our working directory.
+// Unlike realpath the last component doesn't have to exist
+char* resolve_host_path(const char* path, char* resolved) {
+    if (realpath(path, resolved))
+        return resolved;
+
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    char parent[PATH_MAX];
+    if (*name == '\0' || (size_t)(name - path) >= sizeof(parent))
+        return NULL;
+    if (!slash)
+        strcpy(parent, ".");
+    else if (slash == path)
+        strcpy(parent, "/");
+    else
+        snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+    if (!realpath(parent, resolved))
+        return NULL;
+
+    size_t length = strlen(resolved);
+    if (length + strlen(name) + 2 > PATH_MAX)
+        return NULL;
+    snprintf(resolved + length, PATH_MAX - length, "%s%s", resolved[length - 1] == '/' ? "" : "/", name);
+    return resolved;
+}
+
+// Parse a size such as 4096, 64K or 16M
+unsigned long parse_size(const char* str) {
+    char* end = NULL;
+    unsigned long size = strtoul(str, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return size << 10;
+        case 'm': case 'M': return size << 20;
+        case 'g': case 'G': return size << 30;
+        default:
+            return size;
+    }
+}
+
 error_t parse_option(int key, char* arg, struct argp_state* state) {
     struct Arguments* arguments = state->input;
     int arg_count = state->argc - state->next;
     char** args = (state->argv + state->next);
 
+    if (arguments->server >= 0 && key > 0 && key <= CHAR_MAX && strchr(server_options, key)) {
+        return forward_option(arguments, key, arg, arg_count, args) != 0 ? -1 : 0;
+    }
+    if (arguments->server >= 0 && key == 'S') {
+        printf("A server is already running on " COLOR_MESSAGE "'%s'" NONE "\n", get_socket_path());
+        return -1;
+    }
+    if (key > 0 && key <= CHAR_MAX && strchr(disk_options, key)) {
+        if (load_disk(arguments) != 0) return -1;
+    }
+
     switch (key) {
         case 'c': {
             FSFILE* file = fs_open(arg, "w");
@@ -136,6 +338,21 @@ error_t parse_option(int key, char* arg, struct argp_state* state) {
         }
             break;
 
+        case 'W':
+        case 'A': {
+            int fd = open_input(arg_count, args);
+            if (fd < 0) break;
+            FSFILE* file = fs_open(arg, key == 'A' ? "a" : "w");
+            if (fs_get_error() == 0) {
+                fs_write_fd(file, fd);
+                fs_get_error();
+                fs_close(file);
+            }
+            if (fd != STDIN_FILENO)
+                close(fd);
+        }
+            break;
+
         case 'i': {
             FSFILE* file = fs_open(arg, "r");
             if (fs_get_error() != 0) break;
@@ -158,6 +375,83 @@ error_t parse_option(int key, char* arg, struct argp_state* state) {
         }
             break;
 
+        case 'D': {
+            fs_defrag(arguments->output_file);
+            fs_get_error();
+        }
+            break;
+
+        case 'B': {
+            FILE* input = strcmp(arg, "-") == 0 ? stdin : fopen(arg, "r");
+            if (!input) {
+                printf("'%s': Failed to open batch file\n", arg);
+                return -1;
+            }
+            run_batch(input, arguments->output_file);
+            if (input != stdin)
+                fclose(input);
+        }
+            break;
+
+        case 'I': {
+            import_tree(arg, arg_count > 0 ? args[0] : NULL, arguments->output_file);
+            fs_get_error();
+        }
+            break;
+
+        case 'E': {
+            if (arg_count == 0) {
+                printf("'%s': Missing host path\n", arg);
+                break;
+            }
+            export_tree(arg, args[0], arguments->output_file);
+            fs_get_error();
+        }
+            break;
+
+        case 'C': {
+            if (arguments->disk_loaded) {
+                fs_free();
+                arguments->disk_loaded = 0;
+            }
+            if (convert_disk(arguments->disk_path, arguments->output_file) != 0) {
+                fs_get_error();
+                return -1;
+            }
+            load_disk(arguments);
+        }
+            break;
+
+        case 'S': {
+            serve(arg, arguments->disk_path);
+            fs_get_error();
+        }
+            break;
+
+        case 'Q': {
+            printf("No server is running\n");
+        }
+            break;
+
+        case 's': {
+            arguments->disk_size = parse_size(arg);
+        }
+            break;
+
+        case 'b': {
+            arguments->block_size = parse_size(arg);
+        }
+            break;
+
+        case 'f': {
+            if (arguments->disk_loaded)
+                fs_free();
+            fs_init(arguments->disk_size, arguments->block_size);
+            if (fs_get_error() != 0) return -1;
+            arguments->disk_loaded = 1;
+        }
+            break;
+
         default:
             return 0;
     }
@@ -27,7 +27,7 @@ char* read_open_file(FILE* file) {
 
     rewind(file);
 
-    buffer = (char*)malloc(sizeof(char) * buffer_size);
+    buffer = (char*)malloc(sizeof(char) * (buffer_size + 1));
 
     read_size = fread(buffer, sizeof(char), buffer_size, file);
     buffer[read_size] = '\0';
@@ -39,4 +39,29 @@ char* read_open_file(FILE* file) {
 
     fclose(file);
     return buffer;
-}
\ No newline at end of file
+}
+// Read until the end of a stream that may not be seekable, such as stdin
+// The size is assigned to (unsigned long* size)
+char* read_stream(FILE* file, unsigned long* size) {
+    unsigned long capacity = 1 << 12;
+    char* buffer = malloc(capacity);
+    *size = 0;
+    while (buffer) {
+        *size += fread(buffer + *size, sizeof(char), capacity - *size, file);
+        if (*size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char* grown = realloc(buffer, capacity);
+        if (!grown) {
+            free(buffer);
+            return NULL;
+        }
+        buffer = grown;
+    }
+    if (buffer && ferror(file)) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
@@ -0,0 +1,308 @@
+// server.c
+// Keeps a disk loaded and runs requests from clients on a Unix domain socket.
+// Clients are served one at a time, so operations never interleave. Changes are
+// synced through the journal when a client disconnects
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "fs2.h"
+#include "file_system.h"
+#include "error.h"
+#include "batch.h"
+#include "host.h"
+#include "server.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal);
+static int run_request(const struct Request* request, const char* path, char* data, int fd, const char* disk_path, FILE* output);
+static int serve_client(int client, const char* disk_path);
+
+void stop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+const char* get_socket_path() {
+    const char* path = getenv(SOCKET_PATH_ENV);
+    return path ? path : DEFAULT_SOCKET_PATH;
+}
+
+int read_full(int fd, void* buffer, unsigned long size) {
+    char* to = buffer;
+    while (size > 0) {
+        ssize_t count = read(fd, to, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return -1;
+        to += count;
+        size -= count;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void* buffer, unsigned long size) {
+    const char* from = buffer;
+    while (size > 0) {
+        ssize_t count = write(fd, from, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return -1;
+        from += count;
+        size -= count;
+    }
+    return 0;
+}
+
+// Pass a descriptor to the other end of the socket, along with a single byte
+int send_fd(int socket, int fd) {
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t count;
+    while ((count = sendmsg(socket, &message, 0)) < 0 && errno == EINTR);
+    return count == 1 ? 0 : -1;
+}
+
+// Returns the descriptor sent with send_fd, -1 on failure
+int receive_fd(int socket) {
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+
+    ssize_t count;
+    while ((count = recvmsg(socket, &message, 0)) < 0 && errno == EINTR);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (count != 1 || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int run_request(const struct Request* request, const char* path, char* data, int fd, const char* disk_path, FILE* output) {
+    switch (request->op) {
+        case OP_CREATE:
+        case OP_WRITE:
+        case OP_APPEND: {
+            FSFILE* file = fs_open(path, request->op == OP_APPEND ? "a" : "w");
+            if (!file)
+                return -1;
+            int result = request->data_size ? fs_write(data, request->data_size, file) : 0;
+            fs_close(file);
+            return result;
+        }
+        case OP_WRITE_FD:
+        case OP_APPEND_FD: {
+            FSFILE* file = fs_open(path, request->op == OP_APPEND_FD ? "a" : "w");
+            if (!file)
+                return -1;
+            long result = fs_write_fd(file, fd);
+            fs_close(file);
+            return result < 0 ? -1 : 0;
+        }
+        case OP_READ:
+        case OP_INFO: {
+            FSFILE* file = fs_open(path, "r");
+            if (!file)
+                return -1;
+            int result = 0;
+            if (request->op == OP_READ)
+                result = fs_read(file, output);
+            else
+                fs_print_file_info(file, output);
+            fs_close(file);
+            return result;
+        }
+        case OP_REMOVE:
+            return fs_remove_file(path);
+        case OP_MKDIR: {
+            FSFILE* dir = fs_create_dir(path);
+            fs_close(dir);
+            return dir ? 0 : -1;
+        }
+        case OP_CHDIR:
+            return fs_change_dir(path);
+        case OP_LIST:
+            return fs_list(request->path_size ? path : NULL, output);
+        case OP_PWD:
+            return fs_pwd(output);
+        case OP_DEFRAG:
+            return fs_defrag(output);
+        case OP_EXPORT:
+            return export_tree(path, data, output);
+        case OP_IMPORT:
+            return import_tree(path, request->data_size ? data : NULL, output);
+        case OP_BATCH: {
+            FILE* input = fmemopen(data, request->data_size, "r");
+            if (!input)
+                return -1;
+            int failed = run_batch(input, output);
+            fclose(input);
+            return failed ? -1 : 0;
+        }
+        case OP_FORMAT: {
+            unsigned long sizes[2];
+            if (request->data_size != sizeof(sizes))
+                return -1;
+            memcpy(sizes, data, sizeof(sizes));
+            // The new disk is written under another name and only replaces the image once it's
+            // complete. Freeing the loaded disk syncs it, so any failure goes back to it
+            char new_path[PATH_MAX];
+            snprintf(new_path, sizeof(new_path), "%s.format", disk_path);
+            fs_free();
+            if (fs_init(sizes[0], sizes[1]) != 0) {
+                fs_init_from_disk(disk_path);
+                return -1;
+            }
+            fs_dump_disk(new_path);
+            fs_free();
+            if (is_error() || rename(new_path, disk_path) != 0) {
+                unlink(new_path);
+                if (!is_error())
+                    error(COLOR_MESSAGE "'%s'" NONE ": Failed to replace disk\n", disk_path);
+                fs_init_from_disk(disk_path);
+                return -1;
+            }
+            return fs_init_from_disk(disk_path);
+        }
+        default:
+            error("Unknown request " COLOR_NUMBERS "%u" NONE "\n", request->op);
+            return -1;
+    }
+}
+
+// Returns 1 when the client asked the server to shut down
+int serve_client(int client, const char* disk_path) {
+    struct Request request;
+    while (read_full(client, &request, sizeof(request)) == 0) {
+        char* path = calloc(1, request.path_size + 1);
+        char* data = calloc(1, request.data_size + 1);
+        if (!path || !data || read_full(client, path, request.path_size) != 0 ||
+            read_full(client, data, request.data_size) != 0) {
+            free(path);
+            free(data);
+            break;
+        }
+
+        int fd = -1;
+        if (request.op == OP_WRITE_FD || request.op == OP_APPEND_FD) {
+            fd = receive_fd(client);
+        }
+
+        char* output = NULL;
+        size_t output_size = 0;
+        FILE* stream = open_memstream(&output, &output_size);
+        struct Response response = {0};
+        if (request.op == OP_SHUTDOWN) {
+            stopping = 1;
+        }
+        else if (run_request(&request, path, data, fd, disk_path, stream) != 0 || is_error()) {
+            response.status = -1;
+        }
+        if (!is_initialized() && !is_error())
+            error("%s\n", "File system is not initialized");
+        get_error(stream);
+        fclose(stream);
+        if (fd >= 0)
+            close(fd);
+        response.size = output_size;
+
+        int failed = write_full(client, &response, sizeof(response)) != 0 ||
+            write_full(client, output, output_size) != 0;
+        free(output);
+        free(path);
+        free(data);
+        if (failed || stopping)
+            break;
+    }
+    fs_dump_disk(disk_path);
+    return stopping;
+}
+
+int serve(const char* socket_path, const char* disk_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Socket path is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        error("Failed to create socket\n");
+        return -1;
+    }
+    unlink(socket_path);    // Left behind by a server that didn't shut down
+    // Requests can read and write host files as our user, so only our user may connect
+    mode_t mask = umask(0077);
+    int bound = bind(server, (struct sockaddr*)&address, sizeof(address));
+    umask(mask);
+    if (bound != 0 || chmod(socket_path, 0600) != 0 || listen(server, 16) != 0) {
+        error(COLOR_MESSAGE "'%s'" NONE ": Failed to listen on socket\n", socket_path);
+        close(server);
+        return -1;
+    }
+
+    // No SA_RESTART, so that a signal interrupts accept
+    struct sigaction action = { .sa_handler = stop };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving " COLOR_MESSAGE "'%s'" NONE " on " COLOR_MESSAGE "'%s'" NONE "\n", disk_path, socket_path);
+    fflush(stdout);
+    while (!stopping) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        serve_client(client, disk_path);
+        close(client);
+    }
+    close(server);
+    unlink(socket_path);
+    return 0;
+}